@@ -0,0 +1,293 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// The result cache behind imp's -C FILE: final variables and exit
+// status of earlier runs, kept in a file that every imp process using
+// it maps shared, so a program image rerun on input it has seen before
+// skips run_k altogether.
+//
+// A run is keyed by a 128-bit hash of the permanent arena as loaded
+// (before prepare_procs, -r or -O touch it, so those flags share
+// entries), the root, the initial variables and the whole input. Only
+// runs whose result is nothing but their variables and exit status
+// are cached: a program that prints is not, and neither is one that
+// reads when stdin is not a regular file, since the input would have
+// to be consumed to hash it.
+//
+// The file is a header and CACHE_SETS sets of CACHE_WAYS slots; a key
+// may go in any slot of its set, and a full set replaces its least
+// recently used slot, so the file never grows. Lookups hold a shared
+// flock and stores an exclusive one. Each slot carries a checksum of
+// its contents, written last: a slot left half written by a process
+// that died mid-store fails it and counts as empty.
+
+// 16 bytes. Good.
+struct node {
+  uint32_t op;
+  uint32_t a;
+  union {
+    struct {
+      uint32_t b;
+      uint32_t c;
+    };
+    int64_t immediate;
+  };
+};
+
+#define Op1(Ix) 16  +Ix
+
+enum OpCode {
+  ACon = 0,
+  AVar = 1,
+  BCon = 2,
+  Read = 15,
+  Assign = Op1(1),
+  Print = Op1(10),
+};
+
+extern struct node* permanent;
+extern struct node* permanent_next;
+extern int io_input(const char** p, size_t* n);
+
+#define CACHE_MAGIC "IMPCACH1"
+#define CACHE_SETS 1024
+#define CACHE_WAYS 4
+// Programs with more variables than this are never cached.
+#define CACHE_MAX_VARS 64
+
+struct cache_header {
+  char magic[8];
+  uint32_t sets;
+  uint32_t ways;
+  // bumped on every use; a slot's stamp is the clock at its last use
+  uint64_t clock;
+  uint64_t reserved[5];
+};
+
+struct cache_slot {
+  uint64_t key[2];
+  // outside the checksum, so a hit can bump it under the shared lock
+  uint64_t stamp;
+  // 0 for an empty slot
+  uint64_t check;
+  int32_t status;
+  uint32_t nvars;
+  int64_t vars[CACHE_MAX_VARS];
+};
+
+#define CACHE_SIZE (sizeof(struct cache_header) + \
+                    (size_t)CACHE_SETS * CACHE_WAYS * sizeof(struct cache_slot))
+
+static int cache_fd = -1;
+static struct cache_header* header;
+static struct cache_slot* slots;
+static uint64_t key[2];
+static uint32_t key_nvars;
+
+// Two independent multiply-xorshift lanes, for 128 bits of key.
+struct hash128 {
+  uint64_t h[2];
+};
+
+static void mix(struct hash128* s, uint64_t w) {
+  s->h[0] = (s->h[0] ^ w) * 0xff51afd7ed558ccdull;
+  s->h[0] ^= s->h[0] >> 32;
+  s->h[1] = (s->h[1] ^ w) * 0xc4ceb9fe1a85ec53ull;
+  s->h[1] ^= s->h[1] >> 29;
+}
+
+static void mix_bytes(struct hash128* s, const char* p, size_t n) {
+  mix(s, n);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, 8);
+    mix(s, w);
+  }
+  uint64_t w = 0;
+  memcpy(&w, p + i, n - i);
+  mix(s, w);
+}
+
+// Only the fields a node's op uses: the builders leave the rest
+// uninitialized.
+static void mix_node(struct hash128* s, struct node n) {
+  mix(s, n.op);
+  if (n.op == ACon || n.op == AVar || n.op == BCon) {
+    mix(s, n.immediate);
+    return;
+  }
+  switch (n.op >> 4) {
+  case 3:
+    mix(s, n.c);
+  case 2:
+    mix(s, n.b);
+  case 1:
+    mix(s, n.a);
+  }
+  if (n.op == Assign) {
+    mix(s, n.immediate);
+  }
+}
+
+static uint64_t slot_check(const struct cache_slot* e) {
+  struct hash128 s = {{0x9e3779b97f4a7c15ull, 0x2545f4914f6cdd1dull}};
+  mix(&s, e->key[0]);
+  mix(&s, e->key[1]);
+  mix(&s, (uint64_t)(uint32_t)e->status << 32 | e->nvars);
+  for (uint32_t i = 0; i < e->nvars && i < CACHE_MAX_VARS; ++i) {
+    mix(&s, e->vars[i]);
+  }
+  return (s.h[0] ^ s.h[1]) | 1;
+}
+
+// Maps the cache file at path, creating it if it does not exist.
+// Returns 0, or -1 if it cannot be opened or is not a cache file of
+// this layout.
+int cache_open(const char* path) {
+  int fd = open(path, O_RDWR | O_CREAT, 0666);
+  if (fd < 0) {
+    return -1;
+  }
+  if (flock(fd, LOCK_EX) != 0) {
+    close(fd);
+    return -1;
+  }
+  struct stat st;
+  struct cache_header h;
+  int ok = fstat(fd, &st) == 0;
+  if (ok && st.st_size == 0) {
+    ok = ftruncate(fd, CACHE_SIZE) == 0;
+    st.st_size = CACHE_SIZE;
+  }
+  ok = ok && (size_t)st.st_size == CACHE_SIZE
+    && pread(fd, &h, sizeof(h), 0) == sizeof(h);
+  static const char zero[8];
+  if (ok && !memcmp(h.magic, zero, 8)) {
+    // new, or its creator died before getting this far
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CACHE_MAGIC, 8);
+    h.sets = CACHE_SETS;
+    h.ways = CACHE_WAYS;
+    ok = pwrite(fd, &h, sizeof(h), 0) == sizeof(h);
+  }
+  ok = ok && !memcmp(h.magic, CACHE_MAGIC, 8)
+    && h.sets == CACHE_SETS && h.ways == CACHE_WAYS;
+  flock(fd, LOCK_UN);
+  void* p = ok ? mmap(NULL, CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+               : MAP_FAILED;
+  if (p == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  cache_fd = fd;
+  header = p;
+  slots = (struct cache_slot*)(header + 1);
+  return 0;
+}
+
+// Computes the key for running pgm from vars over stdin (after
+// io_init). Returns 1, or 0 if the run cannot be cached.
+int cache_key(struct node pgm, const int64_t* vars, int64_t nvars) {
+  int reads = 0;
+  for (struct node* p = permanent; p < permanent_next; ++p) {
+    if (p->op == Print) {
+      return 0;
+    }
+    reads |= p->op == Read;
+  }
+  const char* in = NULL;
+  size_t in_len = 0;
+  if (nvars > CACHE_MAX_VARS || (reads && !io_input(&in, &in_len))) {
+    return 0;
+  }
+  struct hash128 s = {{0x243f6a8885a308d3ull, 0x13198a2e03707344ull}};
+  mix(&s, permanent_next - permanent);
+  for (struct node* p = permanent; p < permanent_next; ++p) {
+    mix_node(&s, *p);
+  }
+  mix_node(&s, pgm);
+  mix(&s, pgm.b);
+  mix(&s, nvars);
+  for (int64_t i = 0; i < nvars; ++i) {
+    mix(&s, vars[i]);
+  }
+  // a program that does not read gets the same key on any input
+  mix(&s, reads);
+  if (reads) {
+    mix_bytes(&s, in, in_len);
+  }
+  key[0] = s.h[0];
+  key[1] = s.h[1];
+  key_nvars = nvars;
+  return 1;
+}
+
+static struct cache_slot* key_set() {
+  return &slots[key[0] % CACHE_SETS * CACHE_WAYS];
+}
+
+static int holds_key(const struct cache_slot* e) {
+  return e->check != 0 && e->key[0] == key[0] && e->key[1] == key[1]
+    && e->nvars == key_nvars && e->check == slot_check(e);
+}
+
+// 1, with the final variables in vars and the exit status in *status,
+// when a run with the key from cache_key is in the cache.
+int cache_lookup(int64_t* vars, int* status) {
+  int hit = 0;
+  flock(cache_fd, LOCK_SH);
+  struct cache_slot* set = key_set();
+  for (int w = 0; !hit && w < CACHE_WAYS; ++w) {
+    struct cache_slot* e = &set[w];
+    if (holds_key(e)) {
+      memcpy(vars, e->vars, key_nvars * sizeof(int64_t));
+      *status = e->status;
+      __atomic_store_n(&e->stamp, __atomic_add_fetch(&header->clock, 1, __ATOMIC_RELAXED),
+                       __ATOMIC_RELAXED);
+      hit = 1;
+    }
+  }
+  flock(cache_fd, LOCK_UN);
+  return hit;
+}
+
+// Records vars and status as the result of the run with the key from
+// cache_key.
+void cache_store(const int64_t* vars, int status) {
+  flock(cache_fd, LOCK_EX);
+  struct cache_slot* set = key_set();
+  struct cache_slot* e = NULL;
+  for (int w = 0; w < CACHE_WAYS; ++w) {
+    struct cache_slot* s = &set[w];
+    if (holds_key(s)) {
+      // another process got there first
+      flock(cache_fd, LOCK_UN);
+      return;
+    }
+    if (s->check == 0 || s->check != slot_check(s)) {
+      e = s;
+      break;
+    }
+    if (!e || s->stamp < e->stamp) {
+      e = s;
+    }
+  }
+  e->check = 0;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  e->key[0] = key[0];
+  e->key[1] = key[1];
+  e->status = status;
+  e->nvars = key_nvars;
+  memcpy(e->vars, vars, key_nvars * sizeof(int64_t));
+  e->stamp = __atomic_add_fetch(&header->clock, 1, __ATOMIC_RELAXED);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  e->check = slot_check(e);
+  flock(cache_fd, LOCK_UN);
+}
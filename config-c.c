@@ -0,0 +1,627 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Serializes a configuration of imp.c's machine in the concrete syntax
+// krun prints it in. Everything is appended to one growable buffer
+// with hand-rolled integer formatting and goes out in a single write,
+// so dumping millions of nodes costs about as much as copying them.
+// Continuation frames print as the K context they stand for, with
+// HOLE where the value being computed goes.
+
+// 16 bytes. Good.
+struct node {
+  uint32_t op;
+  uint32_t a;
+  union {
+    struct {
+      uint32_t b;
+      uint32_t c;
+    };
+    int64_t immediate;
+  };
+};
+
+#define Op1(Ix) 16  +Ix
+#define Op2(Ix) 16*2+Ix
+#define Op3(Ix) 16*3+Ix
+
+enum OpCode {
+  ACon = 0,
+  AVar = 1,
+  BCon = 2,
+  DivR = 3,
+  AddR = 4,
+  LeR = 5,
+  NotF = 6,
+  AssignR = 7,
+  Skip = 8,
+  Nil = 9,
+  Inc = 10,
+  LeVC = 11,
+  GtVC = 12,
+  LeVV = 13,
+  GtVV = 14,
+  Read = 15,
+
+  Not = Op1(0),
+  Assign = Op1(1),
+  DivL = Op1(2),
+  AddL = Op1(3),
+  LeL = Op1(4),
+  AndL = Op1(5),
+  Pgm = Op1(6),
+  Ind = Op1(7),
+  Inv = Op1(8),
+  InvR = Op1(9),
+  Print = Op1(10),
+  PrintR = Op1(11),
+  Return = Op1(12),
+  ReturnR = Op1(13),
+  Ret = Op1(14),
+
+  Div = Op2(0),
+  Add = Op2(1),
+  Le = Op2(2),
+  And = Op2(3),
+  While = Op2(4),
+  Seq = Op2(5),
+  Cons = Op2(6),
+  WhileC = Op2(7),
+  IfC = Op2(8),
+  WhileI = Op2(9),
+  Proc = Op2(10),
+  Call = Op2(11),
+  ArgK = Op2(12),
+  ArgV = Op2(13),
+  ProcM = Op2(14),
+
+  If = Op3(0),
+};
+
+extern struct node* permanent;
+extern struct node* permanent_next;
+extern void io_buffered_input(const char** p, size_t* n);
+extern size_t io_take_output(const char** p);
+
+static char* buf;
+static size_t buf_len;
+static size_t buf_cap;
+
+static void reserve(size_t n) {
+  if (buf_len + n > buf_cap) {
+    while (buf_len + n > buf_cap) {
+      buf_cap = buf_cap ? 2*buf_cap : 0x10000;
+    }
+    buf = realloc(buf, buf_cap);
+    if (!buf) {
+      exit(1);
+    }
+  }
+}
+
+static void put(const char* s, size_t n) {
+  reserve(n);
+  memcpy(buf + buf_len, s, n);
+  buf_len += n;
+}
+
+#define PUT(lit) put(lit, sizeof(lit)-1)
+
+static void put_int(int64_t x) {
+  char tmp[24];
+  char* t = tmp + sizeof(tmp);
+  uint64_t v = x < 0 ? -(uint64_t)x : (uint64_t)x;
+  do {
+    *--t = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  if (x < 0) {
+    *--t = '-';
+  }
+  put(t, tmp + sizeof(tmp) - t);
+}
+
+static const char** names;
+static int64_t name_count;
+
+static void put_var(int64_t id) {
+  if (id >= 0 && id < name_count && names[id]) {
+    put(names[id], strlen(names[id]));
+  } else {
+    PUT("x");
+    put_int(id);
+  }
+}
+
+// Binding strength, for deciding where parentheses go:
+// "/" > "+" > "<=" > "!" > "&&".
+enum {
+  P_ATOM = 5,
+  P_DIV = 4,
+  P_ADD = 3,
+  P_LE = 2,
+  P_NOT = 1,
+  P_AND = 0,
+};
+
+static int prec(struct node n) {
+  switch (n.op) {
+  case Div: return P_DIV;
+  case Add: return P_ADD;
+  case Le:
+  case LeVC:
+  case LeVV: return P_LE;
+  case Not:
+  case GtVC:
+  case GtVV: return P_NOT;
+  case And: return P_AND;
+  case Inv: return prec(permanent[n.a]);
+  default: return P_ATOM;
+  }
+}
+
+static void put_exp(struct node n, int min);
+
+// Procedures have no names in the program; p<index> stands for one.
+static void put_proc(uint32_t proc) {
+  PUT("p");
+  put_int(proc);
+}
+
+// The expressions of the argument list at ix, each preceded by ", "
+// unless it comes first.
+static void put_args(uint32_t ix, int first) {
+  for (; permanent[ix].op == Cons; ix = permanent[ix].b) {
+    if (!first) {
+      PUT(", ");
+    }
+    put_exp(permanent[permanent[ix].a], 0);
+    first = 0;
+  }
+}
+
+// Operand of an operator of strength p; right operands of the
+// left-associative operators need parentheses at equal strength too.
+static void put_operand(struct node n, int p, int right) {
+  put_exp(n, right ? p + 1 : p);
+}
+
+static void put_exp(struct node n, int min) {
+  int p = prec(n);
+  if (p < min) {
+    PUT("(");
+  }
+  switch (n.op) {
+  case ACon:
+    put_int(n.immediate);
+    break;
+  case AVar:
+    put_var(n.immediate);
+    break;
+  case BCon:
+    if (n.immediate) {
+      PUT("true");
+    } else {
+      PUT("false");
+    }
+    break;
+  case Read:
+    PUT("read()");
+    break;
+  case Call:
+    put_proc(n.a);
+    PUT("(");
+    put_args(n.b, 1);
+    PUT(")");
+    break;
+  case Inv:
+    put_exp(permanent[n.a], min);
+    break;
+  case Div:
+    put_operand(permanent[n.a], P_DIV, 0);
+    PUT(" / ");
+    put_operand(permanent[n.b], P_DIV, 1);
+    break;
+  case Add:
+    put_operand(permanent[n.a], P_ADD, 0);
+    PUT(" + ");
+    put_operand(permanent[n.b], P_ADD, 1);
+    break;
+  case Le:
+    put_operand(permanent[n.a], P_LE+1, 0);
+    PUT(" <= ");
+    put_operand(permanent[n.b], P_LE+1, 0);
+    break;
+  case LeVC:
+    put_var(n.a);
+    PUT(" <= ");
+    put_int(n.immediate);
+    break;
+  case LeVV:
+    put_var(n.a);
+    PUT(" <= ");
+    put_var(n.b);
+    break;
+  case Not:
+    PUT("! ");
+    put_exp(permanent[n.a], P_ATOM);
+    break;
+  case GtVC:
+    PUT("! (");
+    put_var(n.a);
+    PUT(" <= ");
+    put_int(n.immediate);
+    PUT(")");
+    break;
+  case GtVV:
+    PUT("! (");
+    put_var(n.a);
+    PUT(" <= ");
+    put_var(n.b);
+    PUT(")");
+    break;
+  case And:
+    put_operand(permanent[n.a], P_AND, 0);
+    PUT(" && ");
+    put_operand(permanent[n.b], P_AND, 1);
+    break;
+  default:
+    PUT("#unknown(");
+    put_int(n.op);
+    PUT(")");
+  }
+  if (p < min) {
+    PUT(")");
+  }
+}
+
+static void put_stmt(struct node n);
+
+static void put_block(struct node n) {
+  if (n.op == Skip) {
+    PUT("{}");
+  } else {
+    PUT("{ ");
+    put_stmt(n);
+    PUT(" }");
+  }
+}
+
+static void put_stmt(struct node n) {
+  // Seq chains iteratively, they can be very long
+  while (n.op == Seq) {
+    put_stmt(permanent[n.a]);
+    PUT(" ");
+    n = permanent[n.b];
+  }
+  switch (n.op) {
+  case Skip:
+    PUT("{}");
+    break;
+  case Assign:
+    put_var(n.immediate);
+    PUT(" = ");
+    put_exp(permanent[n.a], 0);
+    PUT(" ;");
+    break;
+  case Inc:
+    put_var(n.a);
+    PUT(" = ");
+    put_var(n.a);
+    PUT(" + ");
+    put_int(n.immediate);
+    PUT(" ;");
+    break;
+  case Print:
+    PUT("print(");
+    put_exp(permanent[n.a], 0);
+    PUT(") ;");
+    break;
+  case Return:
+    PUT("return ");
+    put_exp(permanent[n.a], 0);
+    PUT(" ;");
+    break;
+  case If:
+    PUT("if (");
+    put_exp(permanent[n.a], 0);
+    PUT(") ");
+    put_block(permanent[n.b]);
+    PUT(" else ");
+    put_block(permanent[n.c]);
+    break;
+  case While:
+  case WhileI:
+    PUT("while (");
+    put_exp(permanent[n.a], 0);
+    PUT(") ");
+    put_block(permanent[n.b]);
+    break;
+  default:
+    put_exp(n, 0);
+  }
+}
+
+// A continuation frame as a K context.
+static void put_frame(struct node f) {
+  switch (f.op) {
+  case DivR:
+    put_int(f.immediate);
+    PUT(" / HOLE");
+    break;
+  case DivL:
+    PUT("HOLE / ");
+    put_operand(permanent[f.a], P_DIV, 1);
+    break;
+  case AddR:
+    put_int(f.immediate);
+    PUT(" + HOLE");
+    break;
+  case AddL:
+    PUT("HOLE + ");
+    put_operand(permanent[f.a], P_ADD, 1);
+    break;
+  case LeR:
+    put_int(f.immediate);
+    PUT(" <= HOLE");
+    break;
+  case LeL:
+    PUT("HOLE <= ");
+    put_operand(permanent[f.a], P_LE+1, 0);
+    break;
+  case NotF:
+    PUT("! HOLE");
+    break;
+  case AndL:
+    PUT("HOLE && ");
+    put_operand(permanent[f.a], P_AND, 1);
+    break;
+  case AssignR:
+    put_var(f.immediate);
+    PUT(" = HOLE ;");
+    break;
+  case PrintR:
+    PUT("print(HOLE) ;");
+    break;
+  case ReturnR:
+    PUT("return HOLE ;");
+    break;
+  case WhileC:
+    // while (B) S => if (B) {S while (B) S} else {}
+    PUT("if (HOLE) { ");
+    put_stmt(permanent[f.b]);
+    PUT(" while (");
+    put_exp(permanent[f.a], 0);
+    PUT(") ");
+    put_block(permanent[f.b]);
+    PUT(" } else {}");
+    break;
+  case IfC:
+    PUT("if (HOLE) ");
+    put_block(permanent[f.a]);
+    PUT(" else ");
+    put_block(permanent[f.b]);
+    break;
+  default:
+    put_stmt(f);
+  }
+}
+
+// An argument being evaluated: the ArgK frame at f, below it the ArgV
+// frames of the arguments before it, last first. Prints the call with
+// HOLE in place and returns the last frame it used.
+static struct node* put_call(struct node* f, struct node* stack_top) {
+  struct node* v = f + 1;
+  while (v < stack_top && v->op == ArgV) {
+    ++v;
+  }
+  put_proc(f->b);
+  PUT("(");
+  for (struct node* a = v - 1; a > f; --a) {
+    put_int(a->immediate);
+    PUT(", ");
+  }
+  PUT("HOLE");
+  put_args(f->a, 0);
+  PUT(")");
+  return v - 1;
+}
+
+// A call frame: the Ret frame at f and the saved parameters below it
+// print as #ret(saved values). The memo key frames under those have
+// no K counterpart. Returns the last frame it used.
+static struct node* put_ret(struct node* f) {
+  PUT("#ret(");
+  for (uint32_t i = 1; i <= f->b; ++i) {
+    if (i > 1) {
+      PUT(" ");
+    }
+    put_var(f[i].a);
+    PUT(" |-> ");
+    put_int(f[i].immediate);
+  }
+  if (f->b == 0) {
+    PUT(".Map");
+  }
+  PUT(")");
+  return f + (f->c ? 2 * f->b : f->b);
+}
+
+// <procs>: every procedure in the arena, as the lambda its
+// declaration binds.
+static void put_procs() {
+  int any = 0;
+  for (struct node* p = permanent; p < permanent_next; ++p) {
+    if (p->op != Proc && p->op != ProcM) {
+      continue;
+    }
+    PUT("    ");
+    put_proc(p - permanent);
+    PUT(" |-> lambda(");
+    int first = 1;
+    for (uint32_t x = p->a; permanent[x].op == Cons; x = permanent[x].b) {
+      if (!first) {
+        PUT(", ");
+      }
+      put_var(permanent[permanent[x].a].immediate);
+      first = 0;
+    }
+    if (first) {
+      PUT(".Ids");
+    }
+    PUT(", ");
+    put_block(permanent[p->b]);
+    PUT(")\n");
+    any = 1;
+  }
+  if (!any) {
+    PUT("    .Map\n");
+  }
+}
+
+// <in>: the input read() has not consumed, up to the first token that
+// is not an int64. For a stream that is only what has been fetched
+// already; waiting for the rest could block forever, and krun's stdin
+// stream is read lazily too.
+static void put_in() {
+  const char* p;
+  size_t n;
+  io_buffered_input(&p, &n);
+  const char* end = p + n;
+  int any = 0;
+  PUT("    ");
+  for (;;) {
+    while (p < end && (*p == ' ' || *p == '\n' || *p == '\t' || *p == '\r')) {
+      ++p;
+    }
+    const char* t = p;
+    if (t < end && *t == '-') {
+      ++t;
+    }
+    // digits while they stay in int64, like io_read_int
+    uint64_t limit = (uint64_t)INT64_MAX + (t != p);
+    uint64_t v = 0;
+    const char* d = t;
+    while (d < end && *d >= '0' && *d <= '9' && v <= (limit - (*d - '0')) / 10) {
+      v = v*10 + (*d++ - '0');
+    }
+    if (d == t || (d < end && *d != ' ' && *d != '\n' && *d != '\t' && *d != '\r')) {
+      break;
+    }
+    if (any) {
+      PUT(" ");
+    }
+    PUT("ListItem(");
+    put(p, d - p);
+    PUT(")");
+    any = 1;
+    p = d;
+  }
+  if (!any) {
+    PUT(".List");
+  }
+  PUT("\n");
+}
+
+// <out>: what print() has buffered but not written, one ListItem per
+// integer and one per newline, as the print rule appends them. Output
+// written before (the buffer fills at 1MB) has gone to stdout, as from
+// krun's stdout stream.
+static void put_out() {
+  const char* p;
+  size_t n = io_take_output(&p);
+  PUT("    ");
+  if (n == 0) {
+    PUT(".List");
+  }
+  for (size_t i = 0; i < n; ) {
+    size_t j = i;
+    while (j < n && p[j] != '\n') {
+      ++j;
+    }
+    if (i > 0) {
+      PUT(" ");
+    }
+    PUT("ListItem(");
+    put(p + i, j - i);
+    PUT(") ListItem(\"\\n\")");
+    i = j + 1;
+  }
+  PUT("\n");
+}
+
+// Writes <T> with the cells imp.k declares, in its order: <k> holding
+// redex (if any) followed by the frames from stack up to stack_top,
+// <state> with every variable declared in the Pgm variable list,
+// <procs>, <in> with the unread input, <out> with the unwritten
+// output, and <exit> holding exit_code. Variables without an entry in
+// var_names (which has var_name_count entries) print as x0, x1, ...,
+// the names print_image_state and imp-conformance's .imp text use.
+void dump_config(struct node* redex, struct node* stack, struct node* stack_top,
+                 uint32_t var_list, int64_t* vars,
+                 const char** var_names, int64_t var_name_count, int exit_code) {
+  names = var_names;
+  name_count = var_name_count;
+  buf_len = 0;
+  PUT("<T>\n  <k>\n    ");
+  int empty = 1;
+  if (redex) {
+    put_stmt(*redex);
+    empty = 0;
+  }
+  for (struct node* f = stack; f < stack_top; ++f) {
+    if (f->op == InvR) {
+      // bookkeeping for the loop optimizer, no K counterpart
+      continue;
+    }
+    if (!empty) {
+      PUT(" ~> ");
+    }
+    if (f->op == ArgK) {
+      f = put_call(f, stack_top);
+    } else if (f->op == Ret) {
+      f = put_ret(f);
+    } else {
+      put_frame(*f);
+    }
+    empty = 0;
+  }
+  if (empty) {
+    PUT(".");
+  }
+  PUT("\n  </k>\n  <state>\n");
+  int any = 0;
+  for (struct node v = permanent[var_list]; v.op == Cons; v = permanent[v.b]) {
+    int64_t id = permanent[v.a].immediate;
+    PUT("    ");
+    put_var(id);
+    PUT(" |-> ");
+    put_int(vars[id]);
+    PUT("\n");
+    any = 1;
+  }
+  if (!any) {
+    PUT("    .Map\n");
+  }
+  PUT("  </state>\n  <procs>\n");
+  put_procs();
+  PUT("  </procs>\n  <in>\n");
+  put_in();
+  PUT("  </in>\n  <out>\n");
+  put_out();
+  PUT("  </out>\n  <exit>\n    ");
+  put_int(exit_code);
+  PUT("\n  </exit>\n</T>\n");
+  const char* p = buf;
+  size_t n = buf_len;
+  while (n > 0) {
+    ssize_t w = write(1, p, n);
+    if (w <= 0) {
+      exit(1);
+    }
+    p += w;
+    n -= w;
+  }
+}
@@ -0,0 +1,231 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Program images: a permanent arena written out as it is in memory, so
+// a generated program can be handed to any backend without a parser.
+// The file is a header followed by the nodes:
+//   "IMPIMG1\n"   magic
+//   uint32_t      number of nodes
+//   uint32_t      reserved, 0
+//   struct node   the Pgm root (not itself in the arena)
+//   struct node   nodes[number of nodes]
+// in host byte order. Children are indices into the image's own node
+// array, and the nodes form trees: every node is the child of at most
+// one node (or of the root) and comes before it, so a backend can walk
+// an image without revisiting nodes or looping. The exceptions are
+// procedures: a Call's a refers to its Proc without being its parent,
+// and a Proc, which nothing has as a child, may come before its
+// parameters and body, since the body calls it.
+
+// 16 bytes. Good.
+struct node {
+  uint32_t op;
+  uint32_t a;
+  union {
+    struct {
+      uint32_t b;
+      uint32_t c;
+    };
+    int64_t immediate;
+  };
+};
+
+#define Op1(Ix) 16  +Ix
+#define Op2(Ix) 16*2+Ix
+
+enum OpCode {
+  AVar = 1,
+  Nil = 9,
+  Assign = Op1(1),
+  Cons = Op2(6),
+  Proc = Op2(10),
+  Call = Op2(11),
+  ProcM = Op2(14),
+};
+
+#define IMAGE_MAGIC "IMPIMG1\n"
+// Bound on variable ids, so a bad image cannot make vars huge.
+#define IMAGE_MAX_VARS (1 << 20)
+
+struct image_header {
+  char magic[8];
+  uint32_t count;
+  uint32_t reserved;
+  struct node root;
+};
+
+extern struct node* permanent;
+extern struct node* permanent_next;
+extern int perm(struct node n);
+
+// Writes count nodes and root to path. Returns 0, or -1 on failure.
+int write_image(const char* path, const struct node* nodes, uint32_t count,
+                struct node root) {
+  FILE* f = fopen(path, "wb");
+  if (!f) {
+    return -1;
+  }
+  struct image_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, IMAGE_MAGIC, 8);
+  h.count = count;
+  h.root = root;
+  int ok = fwrite(&h, sizeof(h), 1, f) == 1
+    && fwrite(nodes, sizeof(struct node), count, f) == count;
+  if (fclose(f) != 0) {
+    ok = 0;
+  }
+  return ok ? 0 : -1;
+}
+
+// 1 when every variable the image reads or assigns is in the Pgm
+// variable list; sets *nvars to one more than the largest id declared.
+static int check_vars(const struct node* nodes, uint32_t count, struct node root,
+                      int64_t* nvars) {
+  int64_t max = -1;
+  uint32_t steps = 0;
+  struct node v = nodes[root.a];
+  for (; v.op == Cons && steps < count; v = nodes[v.b], ++steps) {
+    struct node x = nodes[v.a];
+    if (x.op != AVar || x.immediate < 0 || x.immediate >= IMAGE_MAX_VARS) {
+      return 0;
+    }
+    if (x.immediate > max) {
+      max = x.immediate;
+    }
+  }
+  if (v.op != Nil) {
+    return 0;
+  }
+  uint8_t* declared = calloc(max + 2, 1);
+  if (!declared) {
+    exit(1);
+  }
+  for (v = nodes[root.a]; v.op == Cons; v = nodes[v.b]) {
+    declared[nodes[v.a].immediate] = 1;
+  }
+  int ok = 1;
+  for (uint32_t i = 0; ok && i < count; ++i) {
+    struct node n = nodes[i];
+    if (n.op == AVar || n.op == Assign) {
+      ok = n.immediate >= 0 && n.immediate <= max && declared[n.immediate];
+    }
+  }
+  free(declared);
+  *nvars = max + 1;
+  return ok;
+}
+
+// 1 when the nodes form trees as described at the top.
+static int check_trees(const struct node* nodes, uint32_t count, struct node root) {
+  uint8_t* parents = calloc(count, 1);
+  if (!parents) {
+    exit(1);
+  }
+  int ok = 1;
+  for (uint32_t i = 0; ok && i < count; ++i) {
+    struct node n = nodes[i];
+    uint32_t kids[3];
+    int nkids = 0;
+    switch (n.op == Call ? 0 : n.op >> 4) {
+    case 3:
+      kids[nkids++] = n.c;
+    case 2:
+      kids[nkids++] = n.b;
+    case 1:
+      kids[nkids++] = n.a;
+    }
+    if (n.op == Call) {
+      kids[nkids++] = n.b;
+      ok = nodes[n.a].op == Proc || nodes[n.a].op == ProcM;
+    }
+    int proc = n.op == Proc || n.op == ProcM;
+    for (int k = 0; ok && k < nkids; ++k) {
+      ok = (kids[k] < i || proc) && !parents[kids[k]]++;
+    }
+  }
+  ok = ok && !parents[root.a]++ && !parents[root.b]++;
+  for (uint32_t i = 0; ok && i < count; ++i) {
+    ok = !(parents[i] && (nodes[i].op == Proc || nodes[i].op == ProcM));
+  }
+  free(parents);
+  return ok;
+}
+
+// Appends the nodes of the image at path to the permanent arena through
+// perm(), shifting child indices by wherever they land, stores the
+// shifted Pgm node in *root and the size vars needs in *nvars. Returns
+// 0, or -1 if the file cannot be read or is not a well-formed image
+// (bad magic, truncated, a child index outside the image, nodes that
+// do not form trees, or a variable used without being declared).
+int read_image(const char* path, struct node* root, int64_t* nvars) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    return -1;
+  }
+  struct image_header h;
+  struct node* nodes = NULL;
+  int ok = fread(&h, sizeof(h), 1, f) == 1
+    && !memcmp(h.magic, IMAGE_MAGIC, 8)
+    && h.count > 0;
+  if (ok) {
+    nodes = malloc((size_t)h.count * sizeof(struct node));
+    if (!nodes) {
+      exit(1);
+    }
+    ok = fread(nodes, sizeof(struct node), h.count, f) == h.count;
+  }
+  fclose(f);
+  for (uint32_t i = 0; ok && i < h.count; ++i) {
+    struct node n = nodes[i];
+    switch (n.op >> 4) {
+    case 3:
+      ok &= n.c < h.count;
+    case 2:
+      ok &= n.b < h.count;
+    case 1:
+      ok &= n.a < h.count;
+    }
+  }
+  ok = ok && h.root.a < h.count && h.root.b < h.count
+    && check_trees(nodes, h.count, h.root)
+    && check_vars(nodes, h.count, h.root, nvars);
+  if (!ok) {
+    free(nodes);
+    return -1;
+  }
+  uint32_t base = permanent_next - permanent;
+  for (uint32_t i = 0; i < h.count; ++i) {
+    struct node n = nodes[i];
+    switch (n.op >> 4) {
+    case 3:
+      n.c += base;
+    case 2:
+      n.b += base;
+    case 1:
+      n.a += base;
+    }
+    perm(n);
+  }
+  free(nodes);
+  h.root.a += base;
+  h.root.b += base;
+  *root = h.root;
+  return 0;
+}
+
+// The last line every backend prints for an image: tag, then
+// " x<id>=<value>" for each variable in the Pgm variable list, in
+// declaration order. The conformance harness compares these byte for
+// byte, so all backends go through here.
+void print_image_state(const char* tag, uint32_t var_list, const int64_t* vars) {
+  fputs(tag, stdout);
+  for (struct node v = permanent[var_list]; v.op == Cons; v = permanent[v.b]) {
+    int64_t id = permanent[v.a].immediate;
+    printf(" x%" PRIi64 "=%" PRIi64, id, vars[id]);
+  }
+  putchar('\n');
+}
@@ -2,6 +2,7 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <setjmp.h>
 
 // 16 bytes. Good.
@@ -41,6 +42,15 @@ enum OpCode {
   AssignR = 7,
   Skip = 8,
   Nil = 9,
+  // nullary loop-optimizer forms, see loop-opt.c; a and b are
+  // variables, not children
+  Inc = 10,
+  LeVC = 11,
+  GtVC = 12,
+  LeVV = 13,
+  GtVV = 14,
+  // read()
+  Read = 15,
 
   // unary
   Not = Op1(0),
@@ -52,6 +62,12 @@ enum OpCode {
   AndL = Op1(5),
   Pgm = Op1(6),
   Ind = Op1(7),
+  // loop-invariant expression and the frame that caches its value
+  Inv = Op1(8),
+  InvR = Op1(9),
+  Print = Op1(10),
+  // stack-only
+  PrintR = Op1(11),
 
   // binary
   Div = Op2(0),
@@ -64,6 +80,8 @@ enum OpCode {
   // stack only
   WhileC = Op2(7),
   IfC = Op2(8),
+  // While with Inv nodes inside; c is the loop id
+  WhileI = Op2(9),
 
   // ternary
   If = Op3(0),
@@ -81,6 +99,12 @@ const char* opnames[64] =
     [7]      = "AssignR %4$ld",
     [8]      = "Skip",
     [9]      = "Nil",
+    [10]     = "Inc v%1$d %4$ld",
+    [11]     = "LeVC v%1$d %4$ld",
+    [12]     = "GtVC v%1$d %4$ld",
+    [13]     = "LeVV v%1$d v%2$d",
+    [14]     = "GtVV v%1$d v%2$d",
+    [15]     = "Read",
     [Op1(0)] = "Not %d",
     [Op1(1)] = "Assign v%4$ld %1$d",
     [Op1(2)] = "DivL %d",
@@ -89,6 +113,10 @@ const char* opnames[64] =
     [Op1(5)] = "AndL %d",
     [Op1(6)] = "Pgm %d %d",
     [Op1(7)] = "Ind %d",
+    [Op1(8)] = "Inv %d",
+    [Op1(9)] = "InvR",
+    [Op1(10)] = "Print %d",
+    [Op1(11)] = "PrintR",
     [Op2(0)] = "Div %d %d",
     [Op2(1)] = "Add %d %d",
     [Op2(2)] = "Le %d %d",
@@ -98,6 +126,7 @@ const char* opnames[64] =
     [Op2(6)] = "Cons %d %d",
     [Op2(7)] = "WhileC %d %d",
     [Op2(8)] = "IfC %d %d",
+    [Op2(9)] = "WhileI %d %d %d",
     [Op3(0)] = "If %d %d %d",
   };
 
@@ -141,10 +170,45 @@ void push_node(struct node n) {
   *--stack = n;
 }
 
-int64_t vars[2];
+// One slot per variable id, sized by main once the program is loaded.
+int64_t* vars;
+
+// Loop-optimizer state, see loop-opt.c.
+struct inv_slot {
+  int64_t epoch;
+  int64_t value;
+};
+extern int64_t epoch;
+extern int64_t* loop_epoch;
+extern struct inv_slot* inv_slots;
+extern void optimize_loops(uint32_t body);
+
+// Buffered streams behind read() and print(), see io-c.c.
+extern void io_init();
+extern void io_flush();
+extern int io_read_int(int64_t* out);
+extern void io_print_int(int64_t x);
+
+// Program images, see image-c.c.
+extern int read_image(const char* path, struct node* root, int64_t* nvars);
+extern void print_image_state(const char* tag, uint32_t var_list, const int64_t* vars);
+
+// Set by -i: print every variable at the end, also when stuck.
+int from_image;
+uint32_t pgm_vars;
 
 jmp_buf stuck_tgt;
 
+// Where a stuck evaluation lands, after unwinding to run_k. Exits with
+// status 2, as imp.c does.
+void stuck() {
+  io_flush();
+  if (from_image) {
+    print_image_state("Stuck.", pgm_vars, vars);
+  }
+  exit(2);
+}
+
 int64_t aeval(struct node top) {
   switch(top.op) {
   case ACon:
@@ -160,9 +224,29 @@ int64_t aeval(struct node top) {
     if (d != 0) {
       return n/d;
     }
+    longjmp(stuck_tgt,1);
+  }
+  case Read:
+  {
+    int64_t x;
+    if (!io_read_int(&x)) {
+      longjmp(stuck_tgt,1);
+    }
+    return x;
+  }
+  case Inv:
+  {
+    struct inv_slot* slot = &inv_slots[(uint32_t)top.immediate];
+    int64_t e = loop_epoch[top.immediate >> 32];
+    if (slot->epoch != e) {
+      slot->value = aeval(permanent[top.a]);
+      slot->epoch = e;
+    }
+    return slot->value;
   }
   default:
-    longjmp(stuck_tgt,1);
+    printf("Unknown label %d\n", top.op);
+    exit(3);
   }
 }
 
@@ -176,8 +260,17 @@ uint64_t beval(struct node top) {
       return beval(permanent[top.a]) && beval(permanent[top.b]);
     case Le:
       return aeval(permanent[top.a]) <= aeval(permanent[top.b]);
+    case LeVC:
+      return vars[top.a] <= top.immediate;
+    case GtVC:
+      return vars[top.a] > top.immediate;
+    case LeVV:
+      return vars[top.a] <= vars[top.b];
+    case GtVV:
+      return vars[top.a] > vars[top.b];
     default:
-      longjmp(stuck_tgt,1);
+      printf("Unknown label %d\n", top.op);
+      exit(3);
   }
 }
 
@@ -196,6 +289,9 @@ void exec(struct node top) {
       exec(permanent[top.c]);
     }
     break;
+  case WhileI:
+    loop_epoch[top.c] = ++epoch;
+    // fall through
   case While:
   {
     struct node condition = permanent[top.a];
@@ -211,6 +307,15 @@ void exec(struct node top) {
     vars[top.immediate] = x;
     break;
   }
+  case Inc:
+    vars[top.a] += top.immediate;
+    break;
+  case Print:
+    io_print_int(aeval(permanent[top.a]));
+    break;
+  default:
+    printf("Unknown label %d\n", top.op);
+    exit(3);
   }
 }
 
@@ -224,10 +329,22 @@ void run_k(struct node top) {
   }
   if (!setjmp(stuck_tgt)) {
     exec(body);
+  } else {
+    stuck();
   }
 }
 
 int perm(struct node n) {
+  if (permanent_next == permanent_top) {
+    // everything refers to permanent by index, so it can move
+    long size = permanent_top - permanent;
+    permanent = realloc(permanent, 2*size*sizeof(struct node));
+    if (!permanent) {
+      exit(1);
+    }
+    permanent_next = permanent + size;
+    permanent_top = permanent + 2*size;
+  }
   *permanent_next = n;
   return permanent_next++ - permanent;
 }
@@ -262,6 +379,27 @@ int pAdd(int a, int b) {
 int pLe(int a, int b) {
   return perm(mkBinary(Le,a,b));
 }
+int pBool(int val) {
+  return perm(mkImm(BCon,val));
+}
+int pSkip() {
+  return perm(mkNullary(Skip));
+}
+int pIf(int cond, int t, int e) {
+  return perm(mkTernary(If,cond,t,e));
+}
+int pDiv(int a, int b) {
+  return perm(mkBinary(Div,a,b));
+}
+int pAnd(int a, int b) {
+  return perm(mkBinary(And,a,b));
+}
+int pRead() {
+  return perm(mkNullary(Read));
+}
+int pPrint(int exp) {
+  return perm(mkUnary(Print,exp));
+}
 
 struct node load_sum(long n) {
   int vars = pCons(pVar(0),pCons(pVar(1),pNil()));
@@ -274,6 +412,22 @@ struct node load_sum(long n) {
   return (struct node){Pgm,vars,body,0};
 }
 
+// A streaming filter: reads a count and then that many numbers, and
+// prints the running sum after each one.
+//   int n, sum;
+//   n = read();
+//   while (!(n <= 0)) { sum = sum + read(); print(sum); n = n + -1; }
+struct node load_filter() {
+  int vars = pCons(pVar(0),pCons(pVar(1),pNil()));
+  int body =
+    pSeq(pAssign(pRead(),0),
+         pWhile(pNot(pLe(pVar(0),pCon(0))),
+                pSeq(pAssign(pAdd(pVar(1),pRead()),1),
+                pSeq(pPrint(pVar(1)),
+                     pAssign(pAdd(pVar(0),pCon((uint64_t)-1)),0)))));
+  return (struct node){Pgm,vars,body,0};
+}
+
 struct node load_test(long n) {
   int vars = pCons(pVar(0),pCons(pVar(1),pNil()));
   int body =
@@ -282,11 +436,56 @@ struct node load_test(long n) {
   return (struct node){Pgm,vars,body,0};
 }
 
+// Usage: imp-big-step [-O] N
+//        imp-big-step [-O] -f
+//        imp-big-step [-O] -i FILE
+//   -O  run the loop optimizer (loop-opt.c) before running
+//   -f  run load_filter over stdin
+//   -i  run the program image in FILE (see imp-gen.c) and print every
+//       variable instead of n and sum
 int main(int argc, char** argv) {
+  int optimize = 0, filter = 0;
+  const char* image = NULL;
+  int arg = 1;
+  for (; arg < argc; ++arg) {
+    if (!strcmp(argv[arg], "-O")) {
+      optimize = 1;
+    } else if (!strcmp(argv[arg], "-f")) {
+      filter = 1;
+    } else if (!strcmp(argv[arg], "-i") && arg + 1 < argc) {
+      image = argv[++arg];
+    } else {
+      break;
+    }
+  }
   initGC();
-  struct node pgm = load_sum(atoi(argv[1]));
+  io_init();
+  struct node pgm;
+  int64_t nvars = 2;
+  if (image) {
+    if (read_image(image, &pgm, &nvars)) {
+      fprintf(stderr, "imp-big-step: cannot read image %s\n", image);
+      return 1;
+    }
+    from_image = 1;
+  } else {
+    pgm = filter ? load_filter() : load_sum(atoi(argv[arg]));
+  }
+  vars = calloc(nvars, sizeof(int64_t));
+  if (!vars) {
+    exit(1);
+  }
+  pgm_vars = pgm.a;
+  if (optimize) {
+    optimize_loops(pgm.b);
+  }
   // dump_seg("[%2d] = ",permanent, permanent_next, "\n");
   run_k(pgm);
-  printf("Done. n=%"PRIi64" sum=%"PRIi64"\n",vars[0],vars[1]);
+  io_flush();
+  if (from_image) {
+    print_image_state("Done.", pgm_vars, vars);
+  } else {
+    printf("Done. n=%"PRIi64" sum=%"PRIi64"\n",vars[0],vars[1]);
+  }
   return 0;
 }
@@ -0,0 +1,525 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+// 16 bytes. Good.
+struct node {
+  uint32_t op;
+  uint32_t a;
+  union {
+    struct {
+      uint32_t b;
+      uint32_t c;
+    };
+    int64_t immediate;
+  };
+};
+
+extern struct node mkNullary(uint32_t opcode);
+extern struct node mkImm(uint32_t opcode, uint64_t imm);
+extern struct node mkUnary(uint32_t opcode, uint32_t a);
+extern struct node mkUnaryImm(uint32_t opcode, uint32_t a, uint64_t imm);
+extern struct node mkBinary(uint32_t opcode, uint32_t a, uint32_t b);
+extern struct node mkTernary(uint32_t opcode, uint32_t a, uint32_t b, uint32_t c);
+
+#define Op1(Ix) 16  +Ix
+#define Op2(Ix) 16*2+Ix
+#define Op3(Ix) 16*3+Ix
+
+enum OpCode {
+  // nullary
+  ACon = 0,
+  AVar = 1,
+  BCon = 2,
+  // nullary stack-only
+  DivR = 3,
+  AddR = 4,
+  LeR = 5,
+  NotF = 6,
+  AssignR = 7,
+  Skip = 8,
+  Nil = 9,
+
+  // unary
+  Not = Op1(0),
+  Assign = Op1(1),
+  // unary stack-only
+  DivL = Op1(2),
+  AddL = Op1(3),
+  LeL = Op1(4),
+  AndL = Op1(5),
+  Pgm = Op1(6),
+  Ind = Op1(7),
+
+  // binary
+  Div = Op2(0),
+  Add = Op2(1),
+  Le = Op2(2),
+  And = Op2(3),
+  While = Op2(4),
+  Seq = Op2(5),
+  Cons = Op2(6),
+  // stack only
+  WhileC = Op2(7),
+  IfC = Op2(8),
+
+  // ternary
+  If = Op3(0),
+};
+
+const char* opnames[64] =
+  {
+    [0]      = "ACon %4$ld",
+    [1]      = "AVar v%4$ld",
+    [2]      = "BCon %4$ld",
+    [3]      = "DivR %4$ld",
+    [4]      = "AddR %4$ld",
+    [5]      = "LeR %4$ld",
+    [6]      = "NotF",
+    [7]      = "AssignR %4$ld",
+    [8]      = "Skip",
+    [9]      = "Nil",
+    [Op1(0)] = "Not %d",
+    [Op1(1)] = "Assign v%4$ld %1$d",
+    [Op1(2)] = "DivL %d",
+    [Op1(3)] = "AddL %d",
+    [Op1(4)] = "LeL %d",
+    [Op1(5)] = "AndL %d",
+    [Op1(6)] = "Pgm %d %d",
+    [Op1(7)] = "Ind %d",
+    [Op2(0)] = "Div %d %d",
+    [Op2(1)] = "Add %d %d",
+    [Op2(2)] = "Le %d %d",
+    [Op2(3)] = "And %d %d",
+    [Op2(4)] = "While %d %d",
+    [Op2(5)] = "Seq %d %d",
+    [Op2(6)] = "Cons %d %d",
+    [Op2(7)] = "WhileC %d %d",
+    [Op2(8)] = "IfC %d %d",
+    [Op3(0)] = "If %d %d %d",
+  };
+
+void dump_seg(const char* prefix, struct node* base, struct node* end, const char* suffix) {
+  int ix = 0;
+  while (base < end) {
+    printf(prefix, ix);
+    printf(opnames[base->op], base->a, base->b, base->c, base->immediate);
+    printf("%s", suffix);
+    ++ix;
+    ++base;
+  }
+}
+
+struct node* permanent;
+struct node* permanent_top;
+struct node* permanent_next;
+
+void initGC() {
+  permanent = aligned_alloc(0x10,2048*sizeof(struct node));
+  permanent_top = permanent + 2048;
+  permanent_next = permanent;
+}
+
+// One slot per variable id, sized by main once the program is loaded;
+// compile() bakes addresses of the slots into closures.
+int64_t* vars;
+
+// Program images, see image-c.c.
+extern int read_image(const char* path, struct node* root, int64_t* nvars);
+extern void print_image_state(const char* tag, uint32_t var_list, const int64_t* vars);
+
+// Set by -i: print every variable at the end, also when stuck.
+int from_image;
+uint32_t pgm_vars;
+
+jmp_buf stuck_tgt;
+
+// A closure is a node that has been decoded once: the handler for its
+// shape plus operands already resolved to what the handler needs, so
+// evaluation is one indirect call per node and no switch.
+struct closure {
+  union {
+    int64_t (*eval)(struct closure*);
+    void (*exec)(struct closure*);
+  };
+  union {
+    struct closure* l;
+    int64_t* lv;
+    struct closure** stmts;
+  };
+  union {
+    struct closure* r;
+    int64_t* rv;
+    int64_t count;
+  };
+  union {
+    struct closure* e;
+    int64_t* ev;
+    int64_t k;
+  };
+};
+
+// Closures point at each other, so they are allocated in chunks that
+// never move. A node reached through several parents is compiled once
+// for each, so the chunk compile() starts with can run out.
+struct closure* closures_next;
+struct closure* closures_end;
+size_t closures_chunk;
+
+struct closure* alloc_closure() {
+  if (closures_next == closures_end) {
+    closures_next = malloc(closures_chunk*sizeof(struct closure));
+    if (!closures_next) {
+      exit(1);
+    }
+    closures_end = closures_next + closures_chunk;
+  }
+  return closures_next++;
+}
+
+// arithmetic
+int64_t c_con(struct closure* c) { return c->k; }
+int64_t c_var(struct closure* c) { return *c->lv; }
+int64_t c_add(struct closure* c) { return c->l->eval(c->l) + c->r->eval(c->r); }
+int64_t c_add_vc(struct closure* c) { return *c->lv + c->k; }
+int64_t c_add_vv(struct closure* c) { return *c->lv + *c->rv; }
+int64_t c_div(struct closure* c) {
+  int64_t n = c->l->eval(c->l);
+  int64_t d = c->r->eval(c->r);
+  if (d == 0) {
+    longjmp(stuck_tgt,1);
+  }
+  return n/d;
+}
+// divisor is a nonzero constant, so this one cannot get stuck
+int64_t c_div_c(struct closure* c) { return c->l->eval(c->l) / c->k; }
+
+// boolean
+int64_t c_bcon(struct closure* c) { return c->k; }
+int64_t c_not(struct closure* c) { return !c->l->eval(c->l); }
+int64_t c_and(struct closure* c) { return c->l->eval(c->l) && c->r->eval(c->r); }
+int64_t c_le(struct closure* c) {
+  int64_t l = c->l->eval(c->l);
+  return l <= c->r->eval(c->r);
+}
+int64_t c_le_vc(struct closure* c) { return *c->lv <= c->k; }
+int64_t c_not_le_vc(struct closure* c) { return *c->lv > c->k; }
+
+// statements
+void c_skip(struct closure* c) { }
+void c_block(struct closure* c) {
+  struct closure** s = c->stmts;
+  for (int64_t i = 0; i < c->count; ++i) {
+    s[i]->exec(s[i]);
+  }
+}
+void c_if(struct closure* c) {
+  if (c->l->eval(c->l)) {
+    c->r->exec(c->r);
+  } else {
+    c->e->exec(c->e);
+  }
+}
+void c_while(struct closure* c) {
+  while (c->l->eval(c->l)) {
+    c->r->exec(c->r);
+  }
+}
+void c_assign(struct closure* c) { *c->lv = c->r->eval(c->r); }
+void c_assign_c(struct closure* c) { *c->lv = c->k; }
+void c_assign_vv(struct closure* c) { *c->lv = *c->rv + *c->ev; }
+void c_inc(struct closure* c) { *c->lv += c->k; }
+
+struct closure* compile_aexp(struct node top) {
+  struct closure* c = alloc_closure();
+  switch(top.op) {
+  case ACon:
+    c->eval = c_con;
+    c->k = top.immediate;
+    return c;
+  case AVar:
+    c->eval = c_var;
+    c->lv = &vars[top.immediate];
+    return c;
+  case Add:
+  {
+    struct node l = permanent[top.a];
+    struct node r = permanent[top.b];
+    if (l.op == AVar && r.op == ACon) {
+      c->eval = c_add_vc;
+      c->lv = &vars[l.immediate];
+      c->k = r.immediate;
+    } else if (l.op == AVar && r.op == AVar) {
+      c->eval = c_add_vv;
+      c->lv = &vars[l.immediate];
+      c->rv = &vars[r.immediate];
+    } else {
+      c->eval = c_add;
+      c->l = compile_aexp(l);
+      c->r = compile_aexp(r);
+    }
+    return c;
+  }
+  case Div:
+  {
+    struct node r = permanent[top.b];
+    c->l = compile_aexp(permanent[top.a]);
+    if (r.op == ACon && r.immediate != 0) {
+      c->eval = c_div_c;
+      c->k = r.immediate;
+    } else {
+      c->eval = c_div;
+      c->r = compile_aexp(r);
+    }
+    return c;
+  }
+  default:
+    printf("Unknown label %d\n", top.op);
+    exit(3);
+  }
+}
+
+struct closure* compile_bexp(struct node top) {
+  struct closure* c = alloc_closure();
+  switch(top.op) {
+  case BCon:
+    c->eval = c_bcon;
+    c->k = top.immediate != 0;
+    return c;
+  case Not:
+  {
+    struct node a = permanent[top.a];
+    if (a.op == Le && permanent[a.a].op == AVar && permanent[a.b].op == ACon) {
+      c->eval = c_not_le_vc;
+      c->lv = &vars[permanent[a.a].immediate];
+      c->k = permanent[a.b].immediate;
+    } else {
+      c->eval = c_not;
+      c->l = compile_bexp(a);
+    }
+    return c;
+  }
+  case And:
+    c->eval = c_and;
+    c->l = compile_bexp(permanent[top.a]);
+    c->r = compile_bexp(permanent[top.b]);
+    return c;
+  case Le:
+  {
+    struct node l = permanent[top.a];
+    struct node r = permanent[top.b];
+    if (l.op == AVar && r.op == ACon) {
+      c->eval = c_le_vc;
+      c->lv = &vars[l.immediate];
+      c->k = r.immediate;
+    } else {
+      c->eval = c_le;
+      c->l = compile_aexp(l);
+      c->r = compile_aexp(r);
+    }
+    return c;
+  }
+  default:
+    printf("Unknown label %d\n", top.op);
+    exit(3);
+  }
+}
+
+struct closure* compile_stmt(struct node top);
+
+// Flattens a right-nested chain of Seq into one block.
+struct closure* compile_seq(struct node top) {
+  int64_t count = 0;
+  for (struct node s = top; s.op == Seq; s = permanent[s.b]) {
+    ++count;
+  }
+  struct closure* c = alloc_closure();
+  struct closure** stmts = malloc((count+1)*sizeof(struct closure*));
+  int64_t i = 0;
+  struct node s = top;
+  for (; s.op == Seq; s = permanent[s.b]) {
+    stmts[i++] = compile_stmt(permanent[s.a]);
+  }
+  stmts[i++] = compile_stmt(s);
+  c->exec = c_block;
+  c->stmts = stmts;
+  c->count = i;
+  return c;
+}
+
+struct closure* compile_stmt(struct node top) {
+  struct closure* c;
+  switch(top.op) {
+  case Skip:
+    c = alloc_closure();
+    c->exec = c_skip;
+    return c;
+  case Seq:
+    return compile_seq(top);
+  case If:
+    c = alloc_closure();
+    c->exec = c_if;
+    c->l = compile_bexp(permanent[top.a]);
+    c->r = compile_stmt(permanent[top.b]);
+    c->e = compile_stmt(permanent[top.c]);
+    return c;
+  case While:
+    c = alloc_closure();
+    c->exec = c_while;
+    c->l = compile_bexp(permanent[top.a]);
+    c->r = compile_stmt(permanent[top.b]);
+    return c;
+  case Assign:
+  {
+    struct node e = permanent[top.a];
+    c = alloc_closure();
+    c->lv = &vars[top.immediate];
+    if (e.op == ACon) {
+      c->exec = c_assign_c;
+      c->k = e.immediate;
+    } else if (e.op == Add && permanent[e.a].op == AVar && permanent[e.b].op == ACon
+               && permanent[e.a].immediate == top.immediate) {
+      // x = x + k
+      c->exec = c_inc;
+      c->k = permanent[e.b].immediate;
+    } else if (e.op == Add && permanent[e.a].op == AVar && permanent[e.b].op == AVar) {
+      c->exec = c_assign_vv;
+      c->rv = &vars[permanent[e.a].immediate];
+      c->ev = &vars[permanent[e.b].immediate];
+    } else {
+      c->exec = c_assign;
+      c->r = compile_aexp(e);
+    }
+    return c;
+  }
+  default:
+    printf("Unknown label %d\n", top.op);
+    exit(3);
+  }
+}
+
+// Starts with a chunk of one closure per node, which is enough unless
+// nodes are shared.
+struct closure* compile(struct node body) {
+  closures_chunk = permanent_next - permanent + 1;
+  closures_next = closures_end = NULL;
+  return compile_stmt(body);
+}
+
+void run_k(struct node top) {
+  struct node varList = permanent[top.a];
+  while (varList.op != Nil) {
+    int64_t v = permanent[varList.a].immediate;
+    vars[v] = 0;
+    varList = permanent[varList.b];
+  }
+  struct closure* body = compile(permanent[top.b]);
+  if (!setjmp(stuck_tgt)) {
+    body->exec(body);
+  } else {
+    // stuck, exit with status 2 like imp.c
+    if (from_image) {
+      print_image_state("Stuck.", pgm_vars, vars);
+    }
+    exit(2);
+  }
+}
+int perm(struct node n) {
+  if (permanent_next == permanent_top) {
+    // everything refers to permanent by index, so it can move
+    long size = permanent_top - permanent;
+    permanent = realloc(permanent, 2*size*sizeof(struct node));
+    if (!permanent) {
+      exit(1);
+    }
+    permanent_next = permanent + size;
+    permanent_top = permanent + 2*size;
+  }
+  *permanent_next = n;
+  return permanent_next++ - permanent;
+}
+
+int pCons(int l,int r) {
+  return perm(mkBinary(Cons,l,r));
+}
+int pNil() {
+  return perm(mkNullary(Nil));
+}
+int pVar(uint64_t id) {
+  return perm(mkImm(AVar,id));
+}
+int pCon(uint64_t val) {
+  return perm(mkImm(ACon,val));
+}
+int pSeq(int l, int r) {
+  return perm(mkBinary(Seq,l,r));
+}
+int pAssign(int exp, uint64_t id) {
+  return perm(mkUnaryImm(Assign,exp,id));
+}
+int pWhile(int cond, int body) {
+  return perm(mkBinary(While,cond,body));
+}
+int pNot(int a) {
+  return perm(mkUnary(Not,a));
+}
+int pAdd(int a, int b) {
+  return perm(mkBinary(Add,a,b));
+}
+int pLe(int a, int b) {
+  return perm(mkBinary(Le,a,b));
+}
+
+struct node load_sum(long n) {
+  int vars = pCons(pVar(0),pCons(pVar(1),pNil()));
+  int body =
+    pSeq(pAssign(pCon(n),0),
+    pSeq(pAssign(pCon(0),1),
+         pWhile(pNot(pLe(pVar(0),pCon(0))),
+                pSeq(pAssign(pAdd(pVar(1),pVar(0)),1),
+                     pAssign(pAdd(pVar(0),pCon((uint64_t)-1)),0)))));
+  return (struct node){Pgm,vars,body,0};
+}
+
+struct node load_test(long n) {
+  int vars = pCons(pVar(0),pCons(pVar(1),pNil()));
+  int body =
+    pSeq(pAssign(pCon(n),0),
+         pAssign(pCon(0),1));
+  return (struct node){Pgm,vars,body,0};
+}
+
+// Usage: imp-closure N
+//        imp-closure -i FILE
+//   -i  run the program image in FILE (see imp-gen.c) and print every
+//       variable instead of n and sum
+int main(int argc, char** argv) {
+  initGC();
+  struct node pgm;
+  int64_t nvars = 2;
+  if (argc > 2 && !strcmp(argv[1], "-i")) {
+    if (read_image(argv[2], &pgm, &nvars)) {
+      fprintf(stderr, "imp-closure: cannot read image %s\n", argv[2]);
+      return 1;
+    }
+    from_image = 1;
+  } else {
+    pgm = load_sum(atoi(argv[1]));
+  }
+  vars = calloc(nvars, sizeof(int64_t));
+  if (!vars) {
+    exit(1);
+  }
+  pgm_vars = pgm.a;
+  // dump_seg("[%2d] = ",permanent, permanent_next, "\n");
+  run_k(pgm);
+  if (from_image) {
+    print_image_state("Done.", pgm_vars, vars);
+  } else {
+    printf("Done. n=%"PRIi64" sum=%"PRIi64"\n",vars[0],vars[1]);
+  }
+  return 0;
+}
@@ -0,0 +1,835 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// 16 bytes. Good.
+struct node {
+  uint32_t op;
+  uint32_t a;
+  union {
+    struct {
+      uint32_t b;
+      uint32_t c;
+    };
+    int64_t immediate;
+  };
+};
+
+extern struct node mkNullary(uint32_t opcode);
+extern struct node mkImm(uint32_t opcode, uint64_t imm);
+extern struct node mkUnary(uint32_t opcode, uint32_t a);
+extern struct node mkUnaryImm(uint32_t opcode, uint32_t a, uint64_t imm);
+extern struct node mkBinary(uint32_t opcode, uint32_t a, uint32_t b);
+extern struct node mkTernary(uint32_t opcode, uint32_t a, uint32_t b, uint32_t c);
+
+#define Op1(Ix) 16  +Ix
+#define Op2(Ix) 16*2+Ix
+#define Op3(Ix) 16*3+Ix
+
+enum OpCode {
+  // nullary
+  ACon = 0,
+  AVar = 1,
+  BCon = 2,
+  // nullary stack-only
+  DivR = 3,
+  AddR = 4,
+  LeR = 5,
+  NotF = 6,
+  AssignR = 7,
+  Skip = 8,
+  Nil = 9,
+
+  // unary
+  Not = Op1(0),
+  Assign = Op1(1),
+  // unary stack-only
+  DivL = Op1(2),
+  AddL = Op1(3),
+  LeL = Op1(4),
+  AndL = Op1(5),
+  Pgm = Op1(6),
+  Ind = Op1(7),
+
+  // binary
+  Div = Op2(0),
+  Add = Op2(1),
+  Le = Op2(2),
+  And = Op2(3),
+  While = Op2(4),
+  Seq = Op2(5),
+  Cons = Op2(6),
+  // stack only
+  WhileC = Op2(7),
+  IfC = Op2(8),
+
+  // ternary
+  If = Op3(0),
+};
+
+const char* opnames[64] =
+  {
+    [0]      = "ACon %4$ld",
+    [1]      = "AVar v%4$ld",
+    [2]      = "BCon %4$ld",
+    [3]      = "DivR %4$ld",
+    [4]      = "AddR %4$ld",
+    [5]      = "LeR %4$ld",
+    [6]      = "NotF",
+    [7]      = "AssignR %4$ld",
+    [8]      = "Skip",
+    [9]      = "Nil",
+    [Op1(0)] = "Not %d",
+    [Op1(1)] = "Assign v%4$ld %1$d",
+    [Op1(2)] = "DivL %d",
+    [Op1(3)] = "AddL %d",
+    [Op1(4)] = "LeL %d",
+    [Op1(5)] = "AndL %d",
+    [Op1(6)] = "Pgm %d %d",
+    [Op1(7)] = "Ind %d",
+    [Op2(0)] = "Div %d %d",
+    [Op2(1)] = "Add %d %d",
+    [Op2(2)] = "Le %d %d",
+    [Op2(3)] = "And %d %d",
+    [Op2(4)] = "While %d %d",
+    [Op2(5)] = "Seq %d %d",
+    [Op2(6)] = "Cons %d %d",
+    [Op2(7)] = "WhileC %d %d",
+    [Op2(8)] = "IfC %d %d",
+    [Op3(0)] = "If %d %d %d",
+  };
+
+void dump_seg(const char* prefix, struct node* base, struct node* end, const char* suffix) {
+  int ix = 0;
+  while (base < end) {
+    printf(prefix, ix);
+    printf(opnames[base->op], base->a, base->b, base->c, base->immediate);
+    printf("%s", suffix);
+    ++ix;
+    ++base;
+  }
+}
+
+struct node* stack;
+struct node* stack_base;
+struct node* stack_top;
+// lowest committed frame, see stack_fault
+struct node* stack_committed;
+
+struct node* permanent;
+struct node* permanent_top;
+struct node* permanent_next;
+
+#define STACK_RESERVE 0x40000000 // 1GB of address space, 64M frames
+#define STACK_CHUNK   0x10000    // committed 64KB at a time
+#define PAGE_SIZE     0x1000
+
+// Pushes stay a plain decrement: running off the committed part of the
+// stack faults on the guard below it, and the handler commits the next
+// chunk and lets the store retry. Only the lowest page of the
+// reservation is never committed; reaching it is a real overflow.
+void stack_fault(int sig, siginfo_t* info, void* context) {
+  char* addr = info->si_addr;
+  char* low = (char*)stack_base;
+  char* committed = (char*)stack_committed;
+  if (addr < low || addr >= committed) {
+    // not ours, let it crash normally
+    signal(SIGSEGV, SIG_DFL);
+    return;
+  }
+  if (addr < low + PAGE_SIZE) {
+    static const char msg[] = "Stack overflow\n";
+    write(2, msg, sizeof(msg)-1);
+    _exit(4);
+  }
+  char* next = committed - STACK_CHUNK;
+  while (next > addr) {
+    next -= STACK_CHUNK;
+  }
+  if (next < low + PAGE_SIZE) {
+    next = low + PAGE_SIZE;
+  }
+  if (mprotect(next, committed - next, PROT_READ|PROT_WRITE)) {
+    _exit(1);
+  }
+  stack_committed = (struct node*)next;
+}
+
+void initGC() {
+  stack_base = mmap(NULL, STACK_RESERVE, PROT_NONE,
+                    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if (stack_base == MAP_FAILED) {
+    exit(1);
+  }
+  stack_committed = (struct node*)((char*)stack_base + STACK_RESERVE - STACK_CHUNK);
+  if (mprotect(stack_committed, STACK_CHUNK, PROT_READ|PROT_WRITE)) {
+    exit(1);
+  }
+  // The frame at stack_top stays zero, so peeking at an empty stack
+  // reads an op no frame handler matches.
+  stack_top = (struct node*)((char*)stack_base + STACK_RESERVE) - 1;
+  stack = stack_top;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = stack_fault;
+  sa.sa_flags = SA_SIGINFO;
+  sigaction(SIGSEGV, &sa, NULL);
+
+  permanent = aligned_alloc(0x10,2048*sizeof(struct node));
+  permanent_top = permanent + 2048;
+  permanent_next = permanent;
+}
+
+void push_node(struct node n) {
+  *--stack = n;
+}
+
+// Compact encoding of the permanent program as a stream of 32-bit
+// words. The first word of every node is
+//   bits 0-5   opcode
+//   bits 6-7   format
+//   bits 8-31  payload
+// Format 0 is the short form and is always a single word:
+//   nullary         payload unused
+//   ACon/AVar/BCon  payload is the immediate, signed
+//   unary           payload is the distance back to the child
+//   Assign          12 bits distance back to the child, 12 bits variable
+//   binary          12 bits distance back to each child
+//   ternary         8 bits distance back to each child
+// Format 1 stores operands in full in the following words: a 64-bit
+// immediate, or one absolute word index per child (plus the variable
+// for Assign). The p* builders create children before their parents,
+// so almost every reference is a short distance back.
+// Nodes are addressed by word index, and decode() hands back a normal
+// struct node whose a/b/c are word indices again, so run_k is unchanged
+// apart from going through LOAD.
+enum Format {
+  Short = 0,
+  Long = 1,
+};
+
+uint32_t* compact;
+uint32_t* compact_next;
+
+static inline uint32_t word0(uint32_t op, uint32_t fmt, uint32_t payload) {
+  return op | fmt << 6 | payload << 8;
+}
+
+static inline int fits_signed(int64_t x, int bits) {
+  return x >= -((int64_t)1 << (bits-1)) && x < ((int64_t)1 << (bits-1));
+}
+
+static inline int near(uint32_t parent, uint32_t child, int bits) {
+  return child < parent && parent - child < (1u << bits);
+}
+
+static inline void put_imm(int64_t imm) {
+  *compact_next++ = (uint32_t)imm;
+  *compact_next++ = (uint32_t)((uint64_t)imm >> 32);
+}
+
+// Encodes permanent[0..permanent_next) and returns the word index of
+// each node in pos. Forward references always take the long form and
+// are patched once their target has been placed.
+void encode_all(uint32_t* pos) {
+  int64_t n = permanent_next - permanent;
+  compact = malloc(4*n*sizeof(uint32_t));
+  compact_next = compact;
+  // patch list: word to fill, node index it refers to
+  uint32_t* fix_at = malloc(3*n*sizeof(uint32_t));
+  uint32_t* fix_to = malloc(3*n*sizeof(uint32_t));
+  int64_t fixes = 0;
+#define CHILD(ix) do {                           \
+    if ((ix) < i) {                              \
+      *compact_next++ = pos[ix];                 \
+    } else {                                     \
+      fix_at[fixes] = compact_next - compact;    \
+      fix_to[fixes++] = (ix);                    \
+      *compact_next++ = 0;                       \
+    }                                            \
+  } while (0)
+  for (int64_t i = 0; i < n; ++i) {
+    struct node nd = permanent[i];
+    uint32_t here = compact_next - compact;
+    pos[i] = here;
+    uint32_t pa = nd.a < i ? pos[nd.a] : UINT32_MAX;
+    uint32_t pb = nd.b < i ? pos[nd.b] : UINT32_MAX;
+    uint32_t pc = nd.c < i ? pos[nd.c] : UINT32_MAX;
+    switch (nd.op) {
+    case ACon:
+    case AVar:
+    case BCon:
+      if (fits_signed(nd.immediate, 24)) {
+        *compact_next++ = word0(nd.op, Short, (uint32_t)nd.immediate & 0xffffff);
+      } else {
+        *compact_next++ = word0(nd.op, Long, 0);
+        put_imm(nd.immediate);
+      }
+      break;
+    case Skip:
+    case Nil:
+      *compact_next++ = word0(nd.op, Short, 0);
+      break;
+    case Not:
+      if (near(here, pa, 24)) {
+        *compact_next++ = word0(nd.op, Short, here - pa);
+      } else {
+        *compact_next++ = word0(nd.op, Long, 0);
+        CHILD(nd.a);
+      }
+      break;
+    case Assign:
+      if (near(here, pa, 12) && nd.immediate >= 0 && nd.immediate < (1 << 12)) {
+        *compact_next++ = word0(nd.op, Short, (here - pa) | (uint32_t)nd.immediate << 12);
+      } else {
+        *compact_next++ = word0(nd.op, Long, 0);
+        CHILD(nd.a);
+        put_imm(nd.immediate);
+      }
+      break;
+    case Div:
+    case Add:
+    case Le:
+    case And:
+    case While:
+    case Seq:
+    case Cons:
+      if (near(here, pa, 12) && near(here, pb, 12)) {
+        *compact_next++ = word0(nd.op, Short, (here - pa) | (here - pb) << 12);
+      } else {
+        *compact_next++ = word0(nd.op, Long, 0);
+        CHILD(nd.a);
+        CHILD(nd.b);
+      }
+      break;
+    case If:
+      if (near(here, pa, 8) && near(here, pb, 8) && near(here, pc, 8)) {
+        *compact_next++ = word0(nd.op, Short, (here - pa) | (here - pb) << 8 | (here - pc) << 16);
+      } else {
+        *compact_next++ = word0(nd.op, Long, 0);
+        CHILD(nd.a);
+        CHILD(nd.b);
+        CHILD(nd.c);
+      }
+      break;
+    default:
+      printf("Cannot encode label %d\n", nd.op);
+      exit(3);
+    }
+  }
+#undef CHILD
+  for (int64_t f = 0; f < fixes; ++f) {
+    compact[fix_at[f]] = pos[fix_to[f]];
+  }
+  free(fix_at);
+  free(fix_to);
+}
+
+static inline int64_t get_imm(uint32_t at) {
+  return (int64_t)((uint64_t)compact[at] | (uint64_t)compact[at+1] << 32);
+}
+
+static inline struct node decode(uint32_t at) {
+  uint32_t w = compact[at];
+  uint32_t op = w & 0x3f;
+  uint32_t payload = w >> 8;
+  struct node n;
+  n.op = op;
+  if ((w >> 6 & 3) == Short) {
+    switch (op >> 4) {
+    case 0:
+      // sign-extend the 24-bit immediate
+      n.immediate = (int64_t)(int32_t)(w & 0xffffff00) >> 8;
+      break;
+    case 1:
+      if (op == Assign) {
+        n.a = at - (payload & 0xfff);
+        n.immediate = payload >> 12;
+      } else {
+        n.a = at - payload;
+      }
+      break;
+    case 2:
+      n.a = at - (payload & 0xfff);
+      n.b = at - (payload >> 12);
+      break;
+    case 3:
+      n.a = at - (payload & 0xff);
+      n.b = at - (payload >> 8 & 0xff);
+      n.c = at - (payload >> 16);
+      break;
+    }
+  } else {
+    switch (op >> 4) {
+    case 0:
+      n.immediate = get_imm(at+1);
+      break;
+    case 1:
+      n.a = compact[at+1];
+      if (op == Assign) {
+        n.immediate = get_imm(at+2);
+      }
+      break;
+    case 2:
+      n.a = compact[at+1];
+      n.b = compact[at+2];
+      break;
+    case 3:
+      n.a = compact[at+1];
+      n.b = compact[at+2];
+      n.c = compact[at+3];
+      break;
+    }
+  }
+  return n;
+}
+
+// Build with -DWIDE to run the same machine over the 16-byte nodes.
+#ifdef WIDE
+#define LOAD(ix) permanent[ix]
+#else
+#define LOAD(ix) decode(ix)
+#endif
+
+// One slot per variable id, sized by main once the program is loaded.
+int64_t* vars;
+
+// Program images, see image-c.c.
+extern int read_image(const char* path, struct node* root, int64_t* nvars);
+extern void print_image_state(const char* tag, uint32_t var_list, const int64_t* vars);
+
+// Set by -i: print every variable at the end, also when stuck. The
+// variable list is read from permanent, which keeps the wide nodes.
+int from_image;
+uint32_t pgm_vars;
+
+void stuck() {
+  if (from_image) {
+    print_image_state("Stuck.", pgm_vars, vars);
+  }
+  exit(2);
+}
+
+void run_k(struct node top) {
+  int64_t acon_val, bcon_val;
+  int64_t assign_var;
+  int opl, opr, op3;
+ pgm:
+  {
+    struct node vl = LOAD(top.a);
+    switch(vl.op) {
+    case Cons:
+      vars[LOAD(vl.a).immediate] = 0;
+      top = (struct node){Pgm,vl.b,top.b,0};
+      goto pgm;
+    case Nil:
+      top = LOAD(top.b);
+      goto stmt;
+    }
+  };
+ stmt:
+  {
+    switch(top.op) {
+    case Skip:
+      goto next_stmt;
+    case Assign:
+      assign_var = top.immediate;
+      opl = top.a;
+      top = LOAD(opl);
+      goto assign;
+    case While:
+      push_node(mkBinary(WhileC,top.a,top.b));
+      top = LOAD(top.a);
+      goto while_op;
+    case Seq:
+      *--stack = LOAD(top.b);
+      opl = top.a;
+      top = LOAD(opl);
+      goto stmt;
+    case If:
+      opr = top.b;
+      op3 = top.c;
+      top = LOAD(top.a);
+      goto if_op;
+    default:
+      printf("Unknown label %d\n", top.op);
+      exit(3);
+    }
+  }
+ next_stmt:
+  {
+    if (stack < stack_top) {
+      top = *stack++;
+      goto stmt;
+    } else {
+      return;
+    }
+  }
+ aexp_nonval:
+  {
+    switch(top.op) {
+    case AVar:
+      acon_val = vars[top.immediate];
+      goto acon;
+    case Div:
+      opr = top.b;
+      top = LOAD(top.a);
+      goto div;
+    case Add:
+      opr = top.b;
+      top = LOAD(top.a);
+      goto add;
+    }
+  }
+ bexp:
+  if (top.op == BCon) {
+    bcon_val = top.immediate;
+    goto bcon;
+  }
+ bexp_nonval:
+  {
+    switch(top.op) {
+    case Not:
+      top = LOAD(top.a);
+      goto not;
+    case Le:
+      opr = top.b;
+      top = LOAD(top.a);
+      goto le;
+    case And:
+      opr = top.b;
+      top = LOAD(top.a);
+      goto and;
+    }
+  }
+ acon:
+  {
+    switch(stack->op) {
+    case DivR:
+      if (acon_val == 0) {
+        stuck();
+      } else {
+        acon_val = stack->immediate / acon_val;
+        ++stack;
+      }
+      goto acon;
+    case AddR:
+      acon_val = stack->immediate + acon_val;
+      ++stack;
+      goto acon;
+    case LeR:
+      bcon_val = stack->immediate <= acon_val;
+      ++stack;
+      goto bcon;
+    case AssignR:
+      vars[stack->immediate] = acon_val;
+      ++stack;
+      goto next_stmt;
+    case DivL:
+      top = LOAD(stack->a);
+      ++stack;
+      goto div_r;
+    case AddL:
+      top = LOAD(stack->a);
+      ++stack;
+      goto add_r;
+    case LeL:
+      top = LOAD(stack->a);
+      ++stack;
+      goto le_r;
+    }
+  }
+ bcon:
+  {
+    switch(stack->op) {
+    case NotF:
+      bcon_val = !bcon_val;
+      ++stack;
+      goto bcon;
+    case AndL:
+      opr = stack->a;
+      ++stack;
+      goto and_exec;
+    case WhileC:
+      if (bcon_val) {
+        stack->op = While;
+        top = LOAD(stack->b);
+        goto stmt;
+      } else {
+        ++stack;
+        goto next_stmt;
+      }
+    case IfC:
+      if(bcon_val) {
+        top = LOAD(stack->a);
+      } else {
+        top = LOAD(stack->b);
+      }
+      ++stack;
+      goto stmt;
+    }
+  }
+ not:
+  {
+    if (top.op == BCon) {
+      bcon_val = !top.immediate;
+      goto bcon;
+    } else {
+      push_node(mkNullary(NotF));
+      goto bexp_nonval;
+    }
+  }
+ div: // left arg loaded in top, right index in opr
+  {
+    if (top.op == ACon) {
+      acon_val = top.immediate;
+      top = LOAD(opr);
+      goto div_r;
+    } else {
+      push_node(mkUnary(DivL,opr));
+      goto aexp_nonval;
+    }
+  }
+ div_r:
+  {
+    if (top.op == ACon) {
+      if (top.immediate == 0) {
+        stuck();
+      } else {
+        acon_val = acon_val / top.immediate;
+        goto acon;
+      }
+    } else {
+      *--stack = (struct node){DivR,0,.immediate=acon_val};
+      goto aexp_nonval;
+    }
+  }
+ add: // left arg loaded in top, right index in opr
+  {
+    if (top.op == ACon) {
+      acon_val = top.immediate;
+      top = LOAD(opr);
+      goto add_r;
+    } else {
+      push_node(mkUnary(AddL,opr));
+      goto aexp_nonval;
+    }
+  }
+ add_r:
+  {
+    if (top.op == ACon) {
+      acon_val = acon_val + top.immediate;
+      goto acon;
+    } else {
+      push_node(mkImm(AddR,acon_val));
+      goto aexp_nonval;
+    }
+  }
+ le:
+  {
+    if (top.op == ACon) {
+      acon_val = top.immediate;
+      top = LOAD(opr);
+      goto le_r;
+    } else {
+      push_node(mkUnary(LeL,opr));
+      goto aexp_nonval;
+    }
+  }
+ le_r:
+  {
+    if(top.op == ACon) {
+      bcon_val = acon_val <= top.immediate;
+      goto bcon;
+    } else {
+      *--stack = (struct node){LeR,0,.immediate = acon_val};
+      goto aexp_nonval;
+    }
+  }
+ and: // left arg loaded in top, right index in opr
+  {
+    if (top.op == BCon) {
+      bcon_val = top.immediate;
+      goto and_exec;
+    } else {
+      push_node(mkUnary(AndL,opr));
+      goto bexp_nonval;
+    }
+  }
+ and_exec:
+  {
+    if (bcon_val) {
+      top = LOAD(opr);
+      goto bexp;
+    } else {
+      goto bcon;
+    }
+  }
+ while_op:
+  {
+    if (top.op == BCon) {
+      if (top.immediate) {
+        stack->op = While;
+        top = LOAD(stack->b);
+        goto stmt;
+      } else {
+        ++stack;
+        goto next_stmt;
+      }
+    } else {
+      goto bexp_nonval;
+    }
+  }
+ if_op: // condition loaded in top, branch indices in opr and op3
+  {
+    if (top.op == BCon) {
+      if (top.immediate) {
+        top = LOAD(opr);
+      } else {
+        top = LOAD(op3);
+      }
+      goto stmt;
+    } else {
+      push_node(mkBinary(IfC,opr,op3));
+      goto bexp_nonval;
+    }
+  }
+ assign:
+  if (top.op == ACon) {
+    vars[assign_var] = top.immediate;
+    goto next_stmt;
+  } else {
+    push_node(mkImm(AssignR,assign_var));
+    goto aexp_nonval;
+  }
+}
+
+int perm(struct node n) {
+  if (permanent_next == permanent_top) {
+    // everything refers to permanent by index, so it can move
+    long size = permanent_top - permanent;
+    permanent = realloc(permanent, 2*size*sizeof(struct node));
+    if (!permanent) {
+      exit(1);
+    }
+    permanent_next = permanent + size;
+    permanent_top = permanent + 2*size;
+  }
+  *permanent_next = n;
+  return permanent_next++ - permanent;
+}
+
+int pCons(int l,int r) {
+  return perm(mkBinary(Cons,l,r));
+}
+int pNil() {
+  return perm(mkNullary(Nil));
+}
+int pVar(uint64_t id) {
+  return perm(mkImm(AVar,id));
+}
+int pCon(uint64_t val) {
+  return perm(mkImm(ACon,val));
+}
+int pSeq(int l, int r) {
+  return perm(mkBinary(Seq,l,r));
+}
+int pAssign(int exp, uint64_t id) {
+  return perm(mkUnaryImm(Assign,exp,id));
+}
+int pWhile(int cond, int body) {
+  return perm(mkBinary(While,cond,body));
+}
+int pNot(int a) {
+  return perm(mkUnary(Not,a));
+}
+int pAdd(int a, int b) {
+  return perm(mkBinary(Add,a,b));
+}
+int pLe(int a, int b) {
+  return perm(mkBinary(Le,a,b));
+}
+
+struct node load_sum(long n) {
+  int vars = pCons(pVar(0),pCons(pVar(1),pNil()));
+  int body =
+    pSeq(pAssign(pCon(n),0),
+    pSeq(pAssign(pCon(0),1),
+         pWhile(pNot(pLe(pVar(0),pCon(0))),
+                pSeq(pAssign(pAdd(pVar(1),pVar(0)),1),
+                     pAssign(pAdd(pVar(0),pCon((uint64_t)-1)),0)))));
+  return (struct node){Pgm,vars,body,0};
+}
+
+// A loop whose body is k assignments, about 6k nodes: with k in the
+// tens of thousands the wide image is several MB and does not fit L2.
+struct node load_big(long n, long k) {
+  int vars = pCons(pVar(0),pCons(pVar(1),pNil()));
+  int body = pAssign(pAdd(pVar(0),pCon((uint64_t)-1)),0);
+  for (long i = k; i > 0; --i) {
+    body = pSeq(pAssign(pAdd(pVar(1),pAdd(pVar(0),pCon(i % 1000))),1), body);
+  }
+  int pgm =
+    pSeq(pAssign(pCon(n),0),
+    pSeq(pAssign(pCon(0),1),
+         pWhile(pNot(pLe(pVar(0),pCon(0))), body)));
+  return (struct node){Pgm,vars,pgm,0};
+}
+
+// Usage: imp-compact N        sum of 1..N
+//        imp-compact N K      load_big(N, K), timed
+//        imp-compact -i FILE  the program image in FILE (see imp-gen.c),
+//                             printing every variable
+// Build once as is and once with -DWIDE to compare the two layouts on
+// the same program, e.g. under perf stat -e cache-misses.
+int main(int argc, char** argv) {
+  initGC();
+  struct node pgm;
+  int64_t nvars = 2;
+  if (argc > 2 && !strcmp(argv[1], "-i")) {
+    if (read_image(argv[2], &pgm, &nvars)) {
+      fprintf(stderr, "imp-compact: cannot read image %s\n", argv[2]);
+      return 1;
+    }
+    from_image = 1;
+  } else {
+    pgm = argc > 2 ? load_big(atol(argv[1]), atol(argv[2])) : load_sum(atoi(argv[1]));
+  }
+  vars = calloc(nvars, sizeof(int64_t));
+  if (!vars) {
+    exit(1);
+  }
+  pgm_vars = pgm.a;
+  long nodes = permanent_next - permanent;
+#ifndef WIDE
+  uint32_t* pos = malloc(nodes*sizeof(uint32_t));
+  encode_all(pos);
+  pgm.a = pos[pgm.a];
+  pgm.b = pos[pgm.b];
+  free(pos);
+  long bytes = (compact_next - compact)*sizeof(uint32_t);
+#else
+  long bytes = nodes*sizeof(struct node);
+#endif
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  run_k(pgm);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (from_image) {
+    print_image_state("Done.", pgm_vars, vars);
+  } else {
+    printf("Done. n=%"PRIi64" sum=%"PRIi64"\n",vars[0],vars[1]);
+  }
+  if (argc > 2 && !from_image) {
+    fprintf(stderr, "%ld nodes, %ld bytes, %.3fs\n", nodes, bytes,
+            (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+  }
+  return 0;
+}
@@ -0,0 +1,383 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// 16 bytes. Good.
+struct node {
+  uint32_t op;
+  uint32_t a;
+  union {
+    struct {
+      uint32_t b;
+      uint32_t c;
+    };
+    int64_t immediate;
+  };
+};
+
+extern struct node mkNullary(uint32_t opcode);
+extern struct node mkImm(uint32_t opcode, uint64_t imm);
+extern struct node mkUnary(uint32_t opcode, uint32_t a);
+extern struct node mkUnaryImm(uint32_t opcode, uint32_t a, uint64_t imm);
+extern struct node mkBinary(uint32_t opcode, uint32_t a, uint32_t b);
+extern struct node mkTernary(uint32_t opcode, uint32_t a, uint32_t b, uint32_t c);
+
+#define Op1(Ix) 16  +Ix
+#define Op2(Ix) 16*2+Ix
+#define Op3(Ix) 16*3+Ix
+
+enum OpCode {
+  // nullary
+  ACon = 0,
+  AVar = 1,
+  BCon = 2,
+  // nullary stack-only
+  DivR = 3,
+  AddR = 4,
+  LeR = 5,
+  NotF = 6,
+  AssignR = 7,
+  Skip = 8,
+  Nil = 9,
+
+  // unary
+  Not = Op1(0),
+  Assign = Op1(1),
+  // unary stack-only
+  DivL = Op1(2),
+  AddL = Op1(3),
+  LeL = Op1(4),
+  AndL = Op1(5),
+  Pgm = Op1(6),
+  Ind = Op1(7),
+
+  // binary
+  Div = Op2(0),
+  Add = Op2(1),
+  Le = Op2(2),
+  And = Op2(3),
+  While = Op2(4),
+  Seq = Op2(5),
+  Cons = Op2(6),
+  // stack only
+  WhileC = Op2(7),
+  IfC = Op2(8),
+
+  // ternary
+  If = Op3(0),
+};
+
+const char* opnames[64] =
+  {
+    [0]      = "ACon %4$ld",
+    [1]      = "AVar v%4$ld",
+    [2]      = "BCon %4$ld",
+    [3]      = "DivR %4$ld",
+    [4]      = "AddR %4$ld",
+    [5]      = "LeR %4$ld",
+    [6]      = "NotF",
+    [7]      = "AssignR %4$ld",
+    [8]      = "Skip",
+    [9]      = "Nil",
+    [Op1(0)] = "Not %d",
+    [Op1(1)] = "Assign v%4$ld %1$d",
+    [Op1(2)] = "DivL %d",
+    [Op1(3)] = "AddL %d",
+    [Op1(4)] = "LeL %d",
+    [Op1(5)] = "AndL %d",
+    [Op1(6)] = "Pgm %d %d",
+    [Op1(7)] = "Ind %d",
+    [Op2(0)] = "Div %d %d",
+    [Op2(1)] = "Add %d %d",
+    [Op2(2)] = "Le %d %d",
+    [Op2(3)] = "And %d %d",
+    [Op2(4)] = "While %d %d",
+    [Op2(5)] = "Seq %d %d",
+    [Op2(6)] = "Cons %d %d",
+    [Op2(7)] = "WhileC %d %d",
+    [Op2(8)] = "IfC %d %d",
+    [Op3(0)] = "If %d %d %d",
+  };
+
+void dump_seg(const char* prefix, struct node* base, struct node* end, const char* suffix) {
+  int ix = 0;
+  while (base < end) {
+    printf(prefix, ix);
+    printf(opnames[base->op], base->a, base->b, base->c, base->immediate);
+    printf("%s", suffix);
+    ++ix;
+    ++base;
+  }
+}
+
+struct node* permanent;
+struct node* permanent_top;
+struct node* permanent_next;
+
+void initGC() {
+  permanent = aligned_alloc(0x10,2048*sizeof(struct node));
+  permanent_top = permanent + 2048;
+  permanent_next = permanent;
+}
+
+// Emits C for the program in the style of sum.c: declarations for the
+// Pgm variable list, then the body with each node turned into the C
+// construct it stands for. Addition wraps like int64_t arithmetic in
+// imp.c, and dividing by zero exits with status 2, as imp.c does when
+// it gets stuck.
+
+void emit_indent(FILE* out, int depth) {
+  for (int i = 0; i < depth; ++i) {
+    fputs("  ", out);
+  }
+}
+
+void emit_aexp(FILE* out, struct node top) {
+  switch(top.op) {
+  case ACon:
+    if (top.immediate == INT64_MIN) {
+      fputs("INT64_MIN", out);
+    } else {
+      fprintf(out, "INT64_C(%"PRIi64")", top.immediate);
+    }
+    break;
+  case AVar:
+    fprintf(out, "v%"PRIi64, top.immediate);
+    break;
+  case Add:
+    fputs("imp_add(", out);
+    emit_aexp(out, permanent[top.a]);
+    fputs(", ", out);
+    emit_aexp(out, permanent[top.b]);
+    fputs(")", out);
+    break;
+  case Div:
+    fputs("imp_div(", out);
+    emit_aexp(out, permanent[top.a]);
+    fputs(", ", out);
+    emit_aexp(out, permanent[top.b]);
+    fputs(")", out);
+    break;
+  default:
+    fprintf(stderr, "Unknown label %d\n", top.op);
+    exit(3);
+  }
+}
+
+void emit_bexp(FILE* out, struct node top) {
+  switch(top.op) {
+  case BCon:
+    fputs(top.immediate ? "1" : "0", out);
+    break;
+  case Not:
+    fputs("!", out);
+    emit_bexp(out, permanent[top.a]);
+    break;
+  case And:
+    fputs("(", out);
+    emit_bexp(out, permanent[top.a]);
+    fputs(" && ", out);
+    emit_bexp(out, permanent[top.b]);
+    fputs(")", out);
+    break;
+  case Le:
+    fputs("(", out);
+    emit_aexp(out, permanent[top.a]);
+    fputs(" <= ", out);
+    emit_aexp(out, permanent[top.b]);
+    fputs(")", out);
+    break;
+  default:
+    fprintf(stderr, "Unknown label %d\n", top.op);
+    exit(3);
+  }
+}
+
+void emit_stmt(FILE* out, struct node top, int depth) {
+  switch(top.op) {
+  case Skip:
+    break;
+  case Seq:
+    // straight-line code for the whole chain
+    while (top.op == Seq) {
+      emit_stmt(out, permanent[top.a], depth);
+      top = permanent[top.b];
+    }
+    emit_stmt(out, top, depth);
+    break;
+  case If:
+    emit_indent(out, depth);
+    fputs("if (", out);
+    emit_bexp(out, permanent[top.a]);
+    fputs(") {\n", out);
+    emit_stmt(out, permanent[top.b], depth+1);
+    emit_indent(out, depth);
+    fputs("} else {\n", out);
+    emit_stmt(out, permanent[top.c], depth+1);
+    emit_indent(out, depth);
+    fputs("}\n", out);
+    break;
+  case While:
+    emit_indent(out, depth);
+    fputs("while (", out);
+    emit_bexp(out, permanent[top.a]);
+    fputs(") {\n", out);
+    emit_stmt(out, permanent[top.b], depth+1);
+    emit_indent(out, depth);
+    fputs("}\n", out);
+    break;
+  case Assign:
+    emit_indent(out, depth);
+    fprintf(out, "v%"PRIi64" = ", top.immediate);
+    emit_aexp(out, permanent[top.a]);
+    fputs(";\n", out);
+    break;
+  default:
+    fprintf(stderr, "Unknown label %d\n", top.op);
+    exit(3);
+  }
+}
+
+// With image set the variables are globals, and the program prints
+// all of them the way print_image_state in image-c.c does, also when
+// it gets stuck.
+void compile(FILE* out, struct node top, int image) {
+  fputs("#include <stdio.h>\n"
+        "#include <stdint.h>\n"
+        "#include <stdlib.h>\n"
+        "#include <inttypes.h>\n"
+        "\n", out);
+  if (image) {
+    for (struct node v = permanent[top.a]; v.op != Nil; v = permanent[v.b]) {
+      fprintf(out, "static int64_t v%"PRIi64";\n", permanent[v.a].immediate);
+    }
+    fputs("\n"
+          "static void imp_state(const char* tag) {\n"
+          "  fputs(tag, stdout);\n", out);
+    for (struct node v = permanent[top.a]; v.op != Nil; v = permanent[v.b]) {
+      int64_t id = permanent[v.a].immediate;
+      fprintf(out, "  printf(\" x%"PRIi64"=%%\"PRIi64, v%"PRIi64");\n", id, id);
+    }
+    fputs("  putchar('\\n');\n"
+          "}\n"
+          "\n", out);
+  }
+  fputs("static inline int64_t imp_add(int64_t a, int64_t b) {\n"
+        "  return (int64_t)((uint64_t)a + (uint64_t)b);\n"
+        "}\n"
+        "static inline int64_t imp_div(int64_t a, int64_t b) {\n"
+        "  if (b == 0) {\n", out);
+  if (image) {
+    fputs("    imp_state(\"Stuck.\");\n", out);
+  }
+  fputs("    exit(2);\n"
+        "  }\n"
+        "  return a / b;\n"
+        "}\n"
+        "\n"
+        "int main(int argc, char* argv[]) {\n", out);
+  for (struct node v = permanent[top.a]; v.op != Nil; v = permanent[v.b]) {
+    if (image) {
+      fprintf(out, "  v%"PRIi64" = 0;\n", permanent[v.a].immediate);
+    } else {
+      fprintf(out, "  int64_t v%"PRIi64" = 0;\n", permanent[v.a].immediate);
+    }
+  }
+  emit_stmt(out, permanent[top.b], 1);
+  if (image) {
+    fputs("  imp_state(\"Done.\");\n", out);
+  } else {
+    fputs("  printf(\"Done. n=%\"PRIi64\" sum=%\"PRIi64\"\\n\",v0,v1);\n", out);
+  }
+  fputs("  return 0;\n"
+        "}\n", out);
+}
+int perm(struct node n) {
+  if (permanent_next == permanent_top) {
+    // everything refers to permanent by index, so it can move
+    long size = permanent_top - permanent;
+    permanent = realloc(permanent, 2*size*sizeof(struct node));
+    if (!permanent) {
+      exit(1);
+    }
+    permanent_next = permanent + size;
+    permanent_top = permanent + 2*size;
+  }
+  *permanent_next = n;
+  return permanent_next++ - permanent;
+}
+
+int pCons(int l,int r) {
+  return perm(mkBinary(Cons,l,r));
+}
+int pNil() {
+  return perm(mkNullary(Nil));
+}
+int pVar(uint64_t id) {
+  return perm(mkImm(AVar,id));
+}
+int pCon(uint64_t val) {
+  return perm(mkImm(ACon,val));
+}
+int pSeq(int l, int r) {
+  return perm(mkBinary(Seq,l,r));
+}
+int pAssign(int exp, uint64_t id) {
+  return perm(mkUnaryImm(Assign,exp,id));
+}
+int pWhile(int cond, int body) {
+  return perm(mkBinary(While,cond,body));
+}
+int pNot(int a) {
+  return perm(mkUnary(Not,a));
+}
+int pAdd(int a, int b) {
+  return perm(mkBinary(Add,a,b));
+}
+int pLe(int a, int b) {
+  return perm(mkBinary(Le,a,b));
+}
+
+struct node load_sum(long n) {
+  int vars = pCons(pVar(0),pCons(pVar(1),pNil()));
+  int body =
+    pSeq(pAssign(pCon(n),0),
+    pSeq(pAssign(pCon(0),1),
+         pWhile(pNot(pLe(pVar(0),pCon(0))),
+                pSeq(pAssign(pAdd(pVar(1),pVar(0)),1),
+                     pAssign(pAdd(pVar(0),pCon((uint64_t)-1)),0)))));
+  return (struct node){Pgm,vars,body,0};
+}
+
+struct node load_test(long n) {
+  int vars = pCons(pVar(0),pCons(pVar(1),pNil()));
+  int body =
+    pSeq(pAssign(pCon(n),0),
+         pAssign(pCon(0),1));
+  return (struct node){Pgm,vars,body,0};
+}
+
+// Usage: imp-compile N > sum-aot.c && cc -O2 sum-aot.c
+//        imp-compile -i FILE > out.c   the program image in FILE (see
+//                                      imp-gen.c)
+
+extern int read_image(const char* path, struct node* root, int64_t* nvars);
+
+int main(int argc, char** argv) {
+  initGC();
+  if (argc > 2 && !strcmp(argv[1], "-i")) {
+    struct node pgm;
+    int64_t nvars;
+    if (read_image(argv[2], &pgm, &nvars)) {
+      fprintf(stderr, "imp-compile: cannot read image %s\n", argv[2]);
+      return 1;
+    }
+    compile(stdout, pgm, 1);
+    return 0;
+  }
+  struct node pgm = load_sum(atoi(argv[1]));
+  compile(stdout, pgm, 0);
+  return 0;
+}
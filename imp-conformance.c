@@ -0,0 +1,555 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+// Differential conformance harness: generates programs with imp-gen,
+// runs each one through every backend, and compares what they print
+// (including the final state line from print_image_state) and how they
+// exit. imp.k is the specification, and all the backends claim to
+// implement it, so any disagreement is a bug in at least one of them.
+// A disagreement is shrunk greedily to a small program that still
+// shows it: statements are replaced by skip or by one of their parts,
+// expressions by one of their operands or a constant, for as long as
+// the same backends keep disagreeing with the first one.
+//
+// Usage: imp-conformance [options] [CMD...]
+//   -s SEED   first generator seed (1); program i uses SEED+i
+//   -c N      number of programs (100)
+//   -t SECS   time limit per run (2)
+//   -G PATH   the generator (./imp-gen)
+//   -g OPTS   extra generator options, e.g. "-n 300 -d 4 -w 10"
+// Each CMD is a shell command that runs a backend on the image whose
+// path replaces every %s in it, or is appended after "-i" if it has
+// none. The first CMD is the reference. Without any CMD the harness
+// runs the interpreters in the current directory:
+//   ./imp, ./imp -O, ./imp-big-step, ./imp-big-step -O, ./imp-closure,
+//   ./imp-compact
+// A backend that exits with status 3 ("Unknown label") does not handle
+// some construct in the program, and sits that program out. The
+// minimal program for each disagreement is written to
+// conformance-SEED.img and printed as .imp text. Exits with status 1
+// if there was any disagreement.
+
+// 16 bytes. Good.
+struct node {
+  uint32_t op;
+  uint32_t a;
+  union {
+    struct {
+      uint32_t b;
+      uint32_t c;
+    };
+    int64_t immediate;
+  };
+};
+
+extern struct node mkNullary(uint32_t opcode);
+extern struct node mkImm(uint32_t opcode, uint64_t imm);
+
+extern int write_image(const char* path, const struct node* nodes, uint32_t count,
+                       struct node root);
+extern int read_image(const char* path, struct node* root, int64_t* nvars);
+
+#define Op1(Ix) 16  +Ix
+#define Op2(Ix) 16*2+Ix
+#define Op3(Ix) 16*3+Ix
+
+enum OpCode {
+  ACon = 0,
+  AVar = 1,
+  BCon = 2,
+  Skip = 8,
+  Nil = 9,
+
+  Not = Op1(0),
+  Assign = Op1(1),
+  Print = Op1(10),
+
+  Div = Op2(0),
+  Add = Op2(1),
+  Le = Op2(2),
+  And = Op2(3),
+  While = Op2(4),
+  Seq = Op2(5),
+  Cons = Op2(6),
+  Proc = Op2(10),
+  ProcM = Op2(14),
+
+  If = Op3(0),
+};
+
+struct node* permanent;
+struct node* permanent_top;
+struct node* permanent_next;
+
+void initGC() {
+  permanent = aligned_alloc(0x10,2048*sizeof(struct node));
+  permanent_top = permanent + 2048;
+  permanent_next = permanent;
+}
+
+int perm(struct node n) {
+  if (permanent_next == permanent_top) {
+    long size = permanent_top - permanent;
+    permanent = realloc(permanent, 2*size*sizeof(struct node));
+    if (!permanent) {
+      exit(1);
+    }
+    permanent_next = permanent + size;
+    permanent_top = permanent + 2*size;
+  }
+  *permanent_next = n;
+  return permanent_next++ - permanent;
+}
+
+// How one backend run ended: its exit status, 128+N if killed by
+// signal N, or TIMED_OUT; and everything it wrote to stdout.
+#define TIMED_OUT -1
+#define UNSUPPORTED 3
+#define MAX_OUTPUT 0x1000000
+
+struct outcome {
+  int status;
+  char* out;
+  size_t len;
+};
+
+static int time_limit = 2;
+
+static void run_shell(const char* cmd, struct outcome* o) {
+  int fd[2];
+  if (pipe(fd)) {
+    exit(1);
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    exit(1);
+  }
+  if (pid == 0) {
+    // own process group, so a timeout takes down everything the
+    // shell started
+    setpgid(0, 0);
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, 0);
+    dup2(null, 2);
+    dup2(fd[1], 1);
+    close(fd[0]);
+    execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+    _exit(127);
+  }
+  setpgid(pid, pid);
+  close(fd[1]);
+  o->len = 0;
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int timed_out = 0;
+  for (;;) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long left = time_limit*1000L
+      - ((now.tv_sec - start.tv_sec)*1000L + (now.tv_nsec - start.tv_nsec)/1000000);
+    struct pollfd p = {fd[0], POLLIN, 0};
+    if (left <= 0 || poll(&p, 1, left) == 0) {
+      timed_out = 1;
+      break;
+    }
+    ssize_t r = read(fd[0], o->out + o->len, MAX_OUTPUT - o->len);
+    if (r <= 0) {
+      break;
+    }
+    o->len += r;
+    if (o->len == MAX_OUTPUT) {
+      break;
+    }
+  }
+  if (timed_out || o->len == MAX_OUTPUT) {
+    kill(-pid, SIGKILL);
+  }
+  close(fd[0]);
+  int st;
+  waitpid(pid, &st, 0);
+  if (timed_out) {
+    o->status = TIMED_OUT;
+  } else if (WIFSIGNALED(st)) {
+    o->status = 128 + WTERMSIG(st);
+  } else {
+    o->status = WEXITSTATUS(st);
+  }
+}
+
+// The command for one backend on one image.
+static char* backend_cmd(const char* tmpl, const char* image) {
+  size_t n = strlen(tmpl) + 8;
+  for (const char* p = strstr(tmpl, "%s"); p; p = strstr(p + 2, "%s")) {
+    n += strlen(image);
+  }
+  char* cmd = malloc(n + strlen(image));
+  if (!cmd) {
+    exit(1);
+  }
+  char* d = cmd;
+  int any = 0;
+  for (const char* p = tmpl; *p; ) {
+    if (p[0] == '%' && p[1] == 's') {
+      d = stpcpy(d, image);
+      p += 2;
+      any = 1;
+    } else {
+      *d++ = *p++;
+    }
+  }
+  *d = 0;
+  if (!any) {
+    d = stpcpy(d, " -i ");
+    stpcpy(d, image);
+  }
+  return cmd;
+}
+
+static const char** backends;
+static int nbackends;
+static struct outcome* outcomes;
+
+static int same(const struct outcome* x, const struct outcome* y) {
+  return x->status == y->status && x->len == y->len && !memcmp(x->out, y->out, x->len);
+}
+
+// Runs every backend on image and returns the set of backends that
+// disagree with the reference (the first one that supports the
+// program), as a bit mask; 0 when they all agree.
+static uint64_t run_all(const char* image) {
+  for (int i = 0; i < nbackends; ++i) {
+    char* cmd = backend_cmd(backends[i], image);
+    run_shell(cmd, &outcomes[i]);
+    free(cmd);
+  }
+  int ref = -1;
+  uint64_t differ = 0;
+  for (int i = 0; i < nbackends; ++i) {
+    if (outcomes[i].status == UNSUPPORTED) {
+      continue;
+    }
+    if (ref < 0) {
+      ref = i;
+    } else if (!same(&outcomes[ref], &outcomes[i])) {
+      differ |= 1ull << i;
+    }
+  }
+  return differ;
+}
+
+// Shrinking works on the program in permanent, replacing nodes in
+// place. The generator never shares subtrees, so a replacement only
+// ever affects the one place it is made.
+static struct node root;
+static const char* work_image;
+static uint64_t target;
+static long runs;
+
+// Copies what the program still reaches into kept, children before
+// their parents as read_image requires, so a saved image holds nothing
+// else: shrinking leaves the nodes it replaced behind, still pointing
+// at children the replacement now has too. Procedures are copied
+// once, however many calls reach them, and ahead of their bodies:
+// they can call themselves.
+static struct node* kept;
+static uint32_t kept_n;
+static uint32_t* kept_proc;
+
+static uint32_t keep(uint32_t ix) {
+  struct node n = permanent[ix];
+  int proc = n.op == Proc || n.op == ProcM;
+  uint32_t at = 0;
+  if (proc) {
+    if (kept_proc[ix] != UINT32_MAX) {
+      return kept_proc[ix];
+    }
+    at = kept_proc[ix] = kept_n++;
+  }
+  switch (n.op >> 4) {
+  case 3:
+    n.c = keep(n.c);
+  case 2:
+    n.b = keep(n.b);
+  case 1:
+    n.a = keep(n.a);
+  }
+  if (!proc) {
+    at = kept_n++;
+  }
+  kept[at] = n;
+  return at;
+}
+
+// Writes what root still reaches to path. Returns 0, or -1 on failure.
+static int write_kept(const char* path) {
+  kept = malloc((permanent_next - permanent)*sizeof(struct node));
+  kept_n = 0;
+  kept_proc = malloc((permanent_next - permanent)*sizeof(uint32_t));
+  if (!kept || !kept_proc) {
+    exit(1);
+  }
+  memset(kept_proc, 0xff, (permanent_next - permanent)*sizeof(uint32_t));
+  struct node r = root;
+  r.a = keep(root.a);
+  r.b = keep(root.b);
+  int err = write_image(path, kept, kept_n, r);
+  free(kept);
+  free(kept_proc);
+  return err;
+}
+
+static int interesting() {
+  if (write_kept(work_image)) {
+    fprintf(stderr, "imp-conformance: cannot write %s\n", work_image);
+    exit(1);
+  }
+  ++runs;
+  return run_all(work_image) == target;
+}
+
+// Tries each replacement for node ix in turn and keeps the first that
+// still disagrees the same way. Returns 1 if one was kept.
+static int try_replace(uint32_t ix, const struct node* cands, int n) {
+  struct node old = permanent[ix];
+  for (int i = 0; i < n; ++i) {
+    permanent[ix] = cands[i];
+    if (interesting()) {
+      return 1;
+    }
+  }
+  permanent[ix] = old;
+  return 0;
+}
+
+enum Kind {
+  STMT,
+  AEXP,
+  BEXP,
+};
+
+// Makes one successful replacement somewhere under ix, looking at
+// bigger subtrees first. Returns 1 if it did.
+static int shrink(uint32_t ix, enum Kind kind) {
+  struct node n = permanent[ix];
+  struct node c[4];
+  int k = 0;
+  switch (kind) {
+  case STMT:
+    if (n.op != Skip) {
+      c[k++] = mkNullary(Skip);
+    }
+    switch (n.op) {
+    case Seq:
+    case While:
+      if (n.op == Seq) {
+        c[k++] = permanent[n.a];
+      }
+      c[k++] = permanent[n.b];
+      break;
+    case If:
+      c[k++] = permanent[n.b];
+      c[k++] = permanent[n.c];
+      break;
+    }
+    break;
+  case AEXP:
+    if (n.op == Add || n.op == Div) {
+      c[k++] = permanent[n.a];
+      c[k++] = permanent[n.b];
+    }
+    // constants only move toward 0
+    if (n.op != ACon || (n.immediate != 0 && n.immediate != 1)) {
+      c[k++] = mkImm(ACon, 0);
+      c[k++] = mkImm(ACon, 1);
+    } else if (n.immediate == 1) {
+      c[k++] = mkImm(ACon, 0);
+    }
+    break;
+  case BEXP:
+    if (n.op == And) {
+      c[k++] = permanent[n.a];
+      c[k++] = permanent[n.b];
+    } else if (n.op == Not) {
+      c[k++] = permanent[n.a];
+    }
+    if (n.op != BCon) {
+      c[k++] = mkImm(BCon, 1);
+      c[k++] = mkImm(BCon, 0);
+    }
+    break;
+  }
+  if (try_replace(ix, c, k)) {
+    return 1;
+  }
+  switch (n.op) {
+  case Seq:
+    return shrink(n.a, STMT) || shrink(n.b, STMT);
+  case If:
+    return shrink(n.a, BEXP) || shrink(n.b, STMT) || shrink(n.c, STMT);
+  case While:
+    return shrink(n.a, BEXP) || shrink(n.b, STMT);
+  case Assign:
+  case Print:
+    return shrink(n.a, AEXP);
+  case Add:
+  case Div:
+    return shrink(n.a, AEXP) || shrink(n.b, AEXP);
+  case Le:
+    return shrink(n.a, AEXP) || shrink(n.b, AEXP);
+  case Not:
+    return shrink(n.a, BEXP);
+  case And:
+    return shrink(n.a, BEXP) || shrink(n.b, BEXP);
+  }
+  return 0;
+}
+
+// Prints each backend's status and the last line it printed, which is
+// the final state; backends marked ! disagree with the reference.
+static void report(uint64_t seed, uint64_t differ) {
+  printf("seed %"PRIu64":\n", seed);
+  for (int i = 0; i < nbackends; ++i) {
+    const struct outcome* o = &outcomes[i];
+    const char* end = o->out + o->len;
+    if (end > o->out && end[-1] == '\n') {
+      --end;
+    }
+    const char* last = end;
+    while (last > o->out && last[-1] != '\n') {
+      --last;
+    }
+    printf("  %c %-24s ", (differ >> i & 1) ? '!' : ' ', backends[i]);
+    if (o->status == TIMED_OUT) {
+      printf("timed out");
+    } else {
+      printf("status %d", o->status);
+    }
+    printf(", %zu bytes: %.*s\n", o->len, (int)(end - last), last);
+  }
+}
+
+int main(int argc, char** argv) {
+  uint64_t seed = 1;
+  long count = 100;
+  const char* gen = "./imp-gen";
+  const char* gen_opts = "";
+  int arg = 1;
+  for (; arg + 1 < argc && argv[arg][0] == '-' && strlen(argv[arg]) == 2; arg += 2) {
+    const char* v = argv[arg+1];
+    switch (argv[arg][1]) {
+    case 's': seed = strtoull(v, NULL, 0); break;
+    case 'c': count = atol(v); break;
+    case 't': time_limit = atoi(v); break;
+    case 'G': gen = v; break;
+    case 'g': gen_opts = v; break;
+    default:
+      fprintf(stderr, "imp-conformance: unknown option %s\n", argv[arg]);
+      return 1;
+    }
+  }
+  static const char* defaults[] = {
+    "./imp", "./imp -O", "./imp-big-step", "./imp-big-step -O",
+    "./imp-closure", "./imp-compact",
+  };
+  if (arg < argc) {
+    backends = (const char**)argv + arg;
+    nbackends = argc - arg;
+  } else {
+    backends = defaults;
+    nbackends = sizeof(defaults)/sizeof(defaults[0]);
+  }
+  if (nbackends > 64) {
+    fprintf(stderr, "imp-conformance: at most 64 backends\n");
+    return 1;
+  }
+  initGC();
+  outcomes = calloc(nbackends, sizeof(struct outcome));
+  for (int i = 0; i < nbackends; ++i) {
+    outcomes[i].out = malloc(MAX_OUTPUT);
+    if (!outcomes[i].out) {
+      exit(1);
+    }
+  }
+  char dir[] = "/tmp/imp-conformance.XXXXXX";
+  if (!mkdtemp(dir)) {
+    fprintf(stderr, "imp-conformance: cannot create a work directory\n");
+    return 1;
+  }
+  char image[64], shrunk[64];
+  snprintf(image, sizeof(image), "%s/p.img", dir);
+  snprintf(shrunk, sizeof(shrunk), "%s/s.img", dir);
+  work_image = shrunk;
+
+  long failures = 0;
+  long skipped = 0;
+  struct outcome gen_out = {0, malloc(MAX_OUTPUT), 0};
+  for (long i = 0; i < count; ++i) {
+    uint64_t s = seed + i;
+    char* cmd = malloc(strlen(gen) + strlen(gen_opts) + strlen(image) + 64);
+    sprintf(cmd, "%s -s %"PRIu64" %s -o %s", gen, s, gen_opts, image);
+    run_shell(cmd, &gen_out);
+    free(cmd);
+    if (gen_out.status != 0) {
+      fprintf(stderr, "imp-conformance: %s failed\n", gen);
+      return 1;
+    }
+    uint64_t differ = run_all(image);
+    int supported = 0;
+    for (int b = 0; b < nbackends; ++b) {
+      supported += outcomes[b].status != UNSUPPORTED;
+    }
+    if (supported < 2) {
+      ++skipped;
+    }
+    if (!differ) {
+      continue;
+    }
+    ++failures;
+    report(s, differ);
+
+    // shrink in a fresh arena
+    permanent_next = permanent;
+    int64_t nvars;
+    if (read_image(image, &root, &nvars)) {
+      fprintf(stderr, "imp-conformance: cannot read %s\n", image);
+      return 1;
+    }
+    target = differ;
+    runs = 0;
+    while (shrink(root.b, STMT)) {
+    }
+    char saved[64];
+    snprintf(saved, sizeof(saved), "conformance-%"PRIu64".img", s);
+    if (write_kept(saved)) {
+      fprintf(stderr, "imp-conformance: cannot write %s\n", saved);
+      return 1;
+    }
+    // rerun for the outcomes of the minimal program
+    report(s, run_all(saved));
+    printf("shrunk to %u nodes in %ld runs, saved as %s:\n", kept_n, runs, saved);
+    fflush(stdout);
+    cmd = malloc(strlen(gen) + strlen(saved) + 8);
+    sprintf(cmd, "%s -p %s", gen, saved);
+    run_shell(cmd, &gen_out);
+    free(cmd);
+    fwrite(gen_out.out, 1, gen_out.len, stdout);
+    putchar('\n');
+  }
+  unlink(image);
+  unlink(shrunk);
+  rmdir(dir);
+  printf("%ld programs, %ld disagreements", count, failures);
+  if (skipped) {
+    printf(", %ld run by fewer than two backends", skipped);
+  }
+  printf("\n");
+  return failures ? 1 : 0;
+}
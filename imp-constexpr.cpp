@@ -0,0 +1,44 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "imp-constexpr.hpp"
+
+// sum.imp with n fixed at compile time, built entirely by the constexpr
+// term builders. Build with
+//   c++ -std=c++20 -O2 imp-constexpr.cpp -DSUM_N=100000000
+#ifndef SUM_N
+#define SUM_N 100
+#endif
+
+constexpr auto load_sum(long n) {
+  imp::program<32> p;
+  uint32_t vars = p.pCons(p.pVar(0),p.pCons(p.pVar(1),p.pNil()));
+  uint32_t body =
+    p.pSeq(p.pAssign(p.pCon(n),0),
+    p.pSeq(p.pAssign(p.pCon(0),1),
+           p.pWhile(p.pNot(p.pLe(p.pVar(0),p.pCon(0))),
+                    p.pSeq(p.pAssign(p.pAdd(p.pVar(1),p.pVar(0)),1),
+                           p.pAssign(p.pAdd(p.pVar(0),p.pCon((uint64_t)-1)),0)))));
+  p.pPgm(vars, body);
+  return p;
+}
+
+static constexpr auto sum_pgm = load_sum(SUM_N);
+
+// Usage: imp-constexpr [-g]
+//   -g  run the generic interpreter over the same .rodata image
+//       instead of the one specialized on it
+int main(int argc, char** argv) {
+  int64_t* vars;
+  if (argc > 1 && !strcmp(argv[1], "-g")) {
+    static int64_t generic_vars[sum_pgm.nvars];
+    imp::run_k(sum_pgm.permanent, generic_vars, sum_pgm.root);
+    vars = generic_vars;
+  } else {
+    imp::machine<sum_pgm>::run_k();
+    vars = imp::machine<sum_pgm>::vars;
+  }
+  printf("Done. n=%" PRIi64 " sum=%" PRIi64 "\n",vars[0],vars[1]);
+  return 0;
+}
@@ -0,0 +1,305 @@
+#ifndef IMP_CONSTEXPR_HPP
+#define IMP_CONSTEXPR_HPP
+
+// Header-only, constexpr version of the term builders from imp.c, so a
+// fixed program can be built at compile time into a static constexpr
+// node array that lands in .rodata, plus two big-step interpreters over
+// such an array: exec() reads it at run time like imp-big-step.c, and
+// machine<P> is instantiated per node of P, so every operand is a
+// compile-time constant in the code it runs.
+// Needs C++20 (constexpr changes of the active union member).
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+
+namespace imp {
+
+// Same 16-byte layout as struct node in imp.c.
+struct node {
+  uint32_t op;
+  uint32_t a;
+  union {
+    struct {
+      uint32_t b;
+      uint32_t c;
+    };
+    int64_t immediate;
+  };
+};
+
+#define Op1(Ix) 16  +Ix
+#define Op2(Ix) 16*2+Ix
+#define Op3(Ix) 16*3+Ix
+
+enum OpCode : uint32_t {
+  ACon = 0,
+  AVar = 1,
+  BCon = 2,
+  Skip = 8,
+  Nil = 9,
+
+  Not = Op1(0),
+  Assign = Op1(1),
+  Pgm = Op1(6),
+
+  Div = Op2(0),
+  Add = Op2(1),
+  Le = Op2(2),
+  And = Op2(3),
+  While = Op2(4),
+  Seq = Op2(5),
+  Cons = Op2(6),
+
+  If = Op3(0),
+};
+
+#undef Op1
+#undef Op2
+#undef Op3
+
+constexpr node mkNullary(uint32_t opcode) {
+  node n{};
+  n.op = opcode;
+  return n;
+}
+constexpr node mkImm(uint32_t opcode, uint64_t imm) {
+  node n{};
+  n.op = opcode;
+  n.immediate = imm;
+  return n;
+}
+constexpr node mkUnary(uint32_t opcode, uint32_t a) {
+  node n{};
+  n.op = opcode;
+  n.a = a;
+  return n;
+}
+constexpr node mkUnaryImm(uint32_t opcode, uint32_t a, uint64_t imm) {
+  node n{};
+  n.op = opcode;
+  n.a = a;
+  n.immediate = imm;
+  return n;
+}
+constexpr node mkBinary(uint32_t opcode, uint32_t a, uint32_t b) {
+  node n{};
+  n.op = opcode;
+  n.a = a;
+  n.b = b;
+  return n;
+}
+constexpr node mkTernary(uint32_t opcode, uint32_t a, uint32_t b, uint32_t c) {
+  node n{};
+  n.op = opcode;
+  n.a = a;
+  n.b = b;
+  n.c = c;
+  return n;
+}
+
+// The permanent arena with room for N nodes, plus the Pgm root and the
+// number of variables the program uses.
+template <std::size_t N>
+struct program {
+  node permanent[N] = {};
+  uint32_t next = 0;
+  uint32_t nvars = 0;
+  node root = {};
+
+  constexpr uint32_t perm(node n) {
+    if (next == N) {
+      throw "program arena full";
+    }
+    permanent[next] = n;
+    return next++;
+  }
+  constexpr void use_var(uint64_t id) {
+    if (id >= nvars) {
+      nvars = id + 1;
+    }
+  }
+
+  constexpr uint32_t pCons(uint32_t l, uint32_t r) { return perm(mkBinary(Cons,l,r)); }
+  constexpr uint32_t pNil() { return perm(mkNullary(Nil)); }
+  constexpr uint32_t pVar(uint64_t id) { use_var(id); return perm(mkImm(AVar,id)); }
+  constexpr uint32_t pCon(uint64_t val) { return perm(mkImm(ACon,val)); }
+  constexpr uint32_t pBool(bool val) { return perm(mkImm(BCon,val)); }
+  constexpr uint32_t pSkip() { return perm(mkNullary(Skip)); }
+  constexpr uint32_t pSeq(uint32_t l, uint32_t r) { return perm(mkBinary(Seq,l,r)); }
+  constexpr uint32_t pAssign(uint32_t exp, uint64_t id) { use_var(id); return perm(mkUnaryImm(Assign,exp,id)); }
+  constexpr uint32_t pWhile(uint32_t cond, uint32_t body) { return perm(mkBinary(While,cond,body)); }
+  constexpr uint32_t pIf(uint32_t cond, uint32_t t, uint32_t e) { return perm(mkTernary(If,cond,t,e)); }
+  constexpr uint32_t pNot(uint32_t a) { return perm(mkUnary(Not,a)); }
+  constexpr uint32_t pAnd(uint32_t a, uint32_t b) { return perm(mkBinary(And,a,b)); }
+  constexpr uint32_t pAdd(uint32_t a, uint32_t b) { return perm(mkBinary(Add,a,b)); }
+  constexpr uint32_t pDiv(uint32_t a, uint32_t b) { return perm(mkBinary(Div,a,b)); }
+  constexpr uint32_t pLe(uint32_t a, uint32_t b) { return perm(mkBinary(Le,a,b)); }
+
+  constexpr void pPgm(uint32_t vars, uint32_t body) { root = mkBinary(Pgm,vars,body); }
+};
+
+// Run-time interpreter over any node array, as in imp-big-step.c.
+// Gets stuck with exit(2), as imp.c does.
+inline int64_t aeval(const node* p, int64_t* vars, node top) {
+  switch (top.op) {
+  case ACon:
+    return top.immediate;
+  case AVar:
+    return vars[top.immediate];
+  case Add:
+    return aeval(p, vars, p[top.a]) + aeval(p, vars, p[top.b]);
+  case Div:
+  {
+    int64_t n = aeval(p, vars, p[top.a]);
+    int64_t d = aeval(p, vars, p[top.b]);
+    if (d == 0) {
+      std::exit(2);
+    }
+    return n / d;
+  }
+  default:
+    std::exit(3);
+  }
+}
+
+inline bool beval(const node* p, int64_t* vars, node top) {
+  switch (top.op) {
+  case BCon:
+    return top.immediate;
+  case Not:
+    return !beval(p, vars, p[top.a]);
+  case And:
+    return beval(p, vars, p[top.a]) && beval(p, vars, p[top.b]);
+  case Le:
+  {
+    int64_t l = aeval(p, vars, p[top.a]);
+    return l <= aeval(p, vars, p[top.b]);
+  }
+  default:
+    std::exit(3);
+  }
+}
+
+inline void exec(const node* p, int64_t* vars, node top) {
+  switch (top.op) {
+  case Skip:
+    break;
+  case Seq:
+    exec(p, vars, p[top.a]);
+    exec(p, vars, p[top.b]);
+    break;
+  case If:
+    if (beval(p, vars, p[top.a])) {
+      exec(p, vars, p[top.b]);
+    } else {
+      exec(p, vars, p[top.c]);
+    }
+    break;
+  case While:
+    while (beval(p, vars, p[top.a])) {
+      exec(p, vars, p[top.b]);
+    }
+    break;
+  case Assign:
+    vars[top.immediate] = aeval(p, vars, p[top.a]);
+    break;
+  default:
+    std::exit(3);
+  }
+}
+
+inline void run_k(const node* p, int64_t* vars, node top) {
+  for (node v = p[top.a]; v.op != Nil; v = p[v.b]) {
+    vars[p[v.a].immediate] = 0;
+  }
+  exec(p, vars, p[top.b]);
+}
+
+// The same interpreter with the program as a template argument: each
+// node gets its own instantiation, the dispatch on op happens at
+// compile time and the operands are constants.
+template <const auto& P>
+struct machine {
+  static inline int64_t vars[P.nvars ? P.nvars : 1];
+
+  template <uint32_t I>
+  static int64_t aeval() {
+    constexpr node n = P.permanent[I];
+    if constexpr (n.op == ACon) {
+      return n.immediate;
+    } else if constexpr (n.op == AVar) {
+      return vars[n.immediate];
+    } else if constexpr (n.op == Add) {
+      return aeval<n.a>() + aeval<n.b>();
+    } else if constexpr (n.op == Div) {
+      int64_t l = aeval<n.a>();
+      int64_t d = aeval<n.b>();
+      if (d == 0) {
+        std::exit(2);
+      }
+      return l / d;
+    } else {
+      static_assert(I != I, "not an arithmetic expression");
+    }
+  }
+
+  template <uint32_t I>
+  static bool beval() {
+    constexpr node n = P.permanent[I];
+    if constexpr (n.op == BCon) {
+      return n.immediate;
+    } else if constexpr (n.op == Not) {
+      return !beval<n.a>();
+    } else if constexpr (n.op == And) {
+      return beval<n.a>() && beval<n.b>();
+    } else if constexpr (n.op == Le) {
+      int64_t l = aeval<n.a>();
+      return l <= aeval<n.b>();
+    } else {
+      static_assert(I != I, "not a boolean expression");
+    }
+  }
+
+  template <uint32_t I>
+  static void exec() {
+    constexpr node n = P.permanent[I];
+    if constexpr (n.op == Skip) {
+    } else if constexpr (n.op == Seq) {
+      exec<n.a>();
+      exec<n.b>();
+    } else if constexpr (n.op == If) {
+      if (beval<n.a>()) {
+        exec<n.b>();
+      } else {
+        exec<n.c>();
+      }
+    } else if constexpr (n.op == While) {
+      while (beval<n.a>()) {
+        exec<n.b>();
+      }
+    } else if constexpr (n.op == Assign) {
+      vars[n.immediate] = aeval<n.a>();
+    } else {
+      static_assert(I != I, "not a statement");
+    }
+  }
+
+  template <uint32_t V>
+  static void declare() {
+    constexpr node v = P.permanent[V];
+    if constexpr (v.op != Nil) {
+      vars[P.permanent[v.a].immediate] = 0;
+      declare<v.b>();
+    }
+  }
+
+  static void run_k() {
+    declare<P.root.a>();
+    exec<P.root.b>();
+  }
+};
+
+} // namespace imp
+
+#endif
@@ -0,0 +1,626 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Seeded generator of random IMP programs, for seeing how the backends
+// scale with program shape rather than just with n in load_sum. The
+// program is built in the permanent arena through the same p*
+// constructors the loaders use, then written out either as .imp text
+// or as a program image (see image-c.c) that backends load directly.
+//
+// Every program terminates: loops only ever count down a counter
+// variable of their own (one per nesting level, never assigned by
+// anything else) from a constant trip count, and procedures only
+// recurse on their first parameter, counting it down and stopping
+// once it is not in 1..U. They can still get stuck dividing by zero,
+// and arithmetic can wrap.
+//
+// Procedure i has one or two parameters, variables of its own after
+// the loop counters, and the body
+//   if (!(p <= 0) && p <= U) { return fi(p + -1, ..) + fi(p + -2, ..); }
+//   else { return E; }
+// with an assignment to a data variable in front of the first return
+// in one procedure out of three. Those, and any that read data
+// variables, are impure; the others only read their parameters and
+// call lower numbered procedures with a first argument of 0..3, which
+// keeps the cost of a call bounded.
+//
+// Usage: imp-gen [options] [-o out]
+//   -s SEED   random seed (1)
+//   -n N      number of statements, roughly (100)
+//   -d D      maximum statement nesting (3)
+//   -e E      maximum expression depth (4)
+//   -v V      number of data variables (4)
+//   -b P      percent of statements that are if (20)
+//   -l P      percent of statements that are while (10)
+//   -t T      maximum loop trip count (10)
+//   -w P      percent of statements that are print (0)
+//   -f F      number of procedures (0)
+//   -c P      percent of expression leaves that are calls, and of loop
+//             conditions that make one, when F > 0 (10)
+//   -u U      recursion bound (10)
+//   -o FILE   write to FILE: an image if it ends in .img, else .imp text
+//             (default: .imp text on stdout)
+//        imp-gen -p FILE.img
+//   prints an existing image as .imp text
+
+// 16 bytes. Good.
+struct node {
+  uint32_t op;
+  uint32_t a;
+  union {
+    struct {
+      uint32_t b;
+      uint32_t c;
+    };
+    int64_t immediate;
+  };
+};
+
+extern struct node mkNullary(uint32_t opcode);
+extern struct node mkImm(uint32_t opcode, uint64_t imm);
+extern struct node mkUnary(uint32_t opcode, uint32_t a);
+extern struct node mkUnaryImm(uint32_t opcode, uint32_t a, uint64_t imm);
+extern struct node mkBinary(uint32_t opcode, uint32_t a, uint32_t b);
+extern struct node mkTernary(uint32_t opcode, uint32_t a, uint32_t b, uint32_t c);
+
+extern int write_image(const char* path, const struct node* nodes, uint32_t count,
+                       struct node root);
+extern int read_image(const char* path, struct node* root, int64_t* nvars);
+
+#define Op1(Ix) 16  +Ix
+#define Op2(Ix) 16*2+Ix
+#define Op3(Ix) 16*3+Ix
+
+enum OpCode {
+  ACon = 0,
+  AVar = 1,
+  BCon = 2,
+  Skip = 8,
+  Nil = 9,
+  Read = 15,
+
+  Not = Op1(0),
+  Assign = Op1(1),
+  Pgm = Op1(6),
+  Print = Op1(10),
+  Return = Op1(12),
+
+  Div = Op2(0),
+  Add = Op2(1),
+  Le = Op2(2),
+  And = Op2(3),
+  While = Op2(4),
+  Seq = Op2(5),
+  Cons = Op2(6),
+  Proc = Op2(10),
+  Call = Op2(11),
+  ProcM = Op2(14),
+
+  If = Op3(0),
+};
+
+struct node* permanent;
+struct node* permanent_top;
+struct node* permanent_next;
+
+void initGC() {
+  permanent = aligned_alloc(0x10,2048*sizeof(struct node));
+  permanent_top = permanent + 2048;
+  permanent_next = permanent;
+}
+
+int perm(struct node n) {
+  if (permanent_next == permanent_top) {
+    long size = permanent_top - permanent;
+    permanent = realloc(permanent, 2*size*sizeof(struct node));
+    if (!permanent) {
+      exit(1);
+    }
+    permanent_next = permanent + size;
+    permanent_top = permanent + 2*size;
+  }
+  *permanent_next = n;
+  return permanent_next++ - permanent;
+}
+
+int pCons(int l,int r) {
+  return perm(mkBinary(Cons,l,r));
+}
+int pNil() {
+  return perm(mkNullary(Nil));
+}
+int pVar(uint64_t id) {
+  return perm(mkImm(AVar,id));
+}
+int pCon(uint64_t val) {
+  return perm(mkImm(ACon,val));
+}
+int pBool(int val) {
+  return perm(mkImm(BCon,val));
+}
+int pSkip() {
+  return perm(mkNullary(Skip));
+}
+int pSeq(int l, int r) {
+  return perm(mkBinary(Seq,l,r));
+}
+int pAssign(int exp, uint64_t id) {
+  return perm(mkUnaryImm(Assign,exp,id));
+}
+int pWhile(int cond, int body) {
+  return perm(mkBinary(While,cond,body));
+}
+int pIf(int cond, int t, int e) {
+  return perm(mkTernary(If,cond,t,e));
+}
+int pNot(int a) {
+  return perm(mkUnary(Not,a));
+}
+int pAnd(int a, int b) {
+  return perm(mkBinary(And,a,b));
+}
+int pAdd(int a, int b) {
+  return perm(mkBinary(Add,a,b));
+}
+int pDiv(int a, int b) {
+  return perm(mkBinary(Div,a,b));
+}
+int pLe(int a, int b) {
+  return perm(mkBinary(Le,a,b));
+}
+int pPrint(int exp) {
+  return perm(mkUnary(Print,exp));
+}
+int pProc(int params, int body) {
+  return perm(mkTernary(Proc,params,body,0));
+}
+int pCall(int proc, int args) {
+  return perm(mkBinary(Call,proc,args));
+}
+int pReturn(int exp) {
+  return perm(mkUnary(Return,exp));
+}
+
+struct gen_params {
+  uint64_t seed;
+  long size;
+  int depth;
+  int exp_depth;
+  int nvars;
+  int branch_pct;
+  int loop_pct;
+  int trips;
+  int print_pct;
+  int procs;
+  int call_pct;
+  int bound;
+};
+
+static uint64_t state;
+static long budget;
+static const struct gen_params* gp;
+
+// The procedures made so far, and where expressions are being made:
+// in the main program (in_proc -1) or in the body of procedure in_proc.
+static int* procs;
+static int* proc_params;
+static int in_proc = -1;
+static int in_impure;
+
+static uint64_t rnd(uint64_t bound) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state % bound;
+}
+
+// Small constants, so divisions and comparisons come out both ways.
+static int gen_con() {
+  return pCon((uint64_t)((int64_t)rnd(21) - 10));
+}
+
+// First variable of procedure i's parameters.
+static uint64_t param_var(int i) {
+  return gp->nvars + gp->depth + 2 * i;
+}
+
+static int gen_aexp(int d);
+
+static int gen_call(int d) {
+  int callee;
+  int args = pNil();
+  if (in_proc < 0) {
+    callee = rnd(gp->procs);
+    for (int k = 1; k < proc_params[callee]; ++k) {
+      args = pCons(gen_aexp(d > 0 ? d - 1 : 0), args);
+    }
+    return pCall(procs[callee], pCons(gen_aexp(d > 0 ? d - 1 : 0), args));
+  }
+  callee = rnd(in_proc);
+  for (int k = 1; k < proc_params[callee]; ++k) {
+    args = pCons(gen_aexp(0), args);
+  }
+  return pCall(procs[callee], pCons(pCon(rnd(4)), args));
+}
+
+static int gen_leaf() {
+  if (in_proc < 0) {
+    // loop counters are fair game to read
+    return pVar(rnd(gp->nvars + gp->depth));
+  }
+  if (in_impure && rnd(2)) {
+    return pVar(rnd(gp->nvars));
+  }
+  return pVar(param_var(in_proc) + rnd(proc_params[in_proc]));
+}
+
+static int gen_aexp(int d) {
+  if (d == 0 || rnd(3) == 0) {
+    int callable = in_proc < 0 ? gp->procs : in_proc;
+    if (callable > 0 && rnd(100) < (uint64_t)gp->call_pct) {
+      return gen_call(d);
+    }
+    return rnd(3) ? gen_leaf() : gen_con();
+  }
+  int l = gen_aexp(d - 1);
+  int r = gen_aexp(d - 1);
+  return rnd(4) ? pAdd(l, r) : pDiv(l, r);
+}
+
+static int gen_bexp(int d) {
+  uint64_t r = rnd(10);
+  if (d == 0 || r < 5) {
+    return r == 0 ? pBool(rnd(2)) : pLe(gen_aexp(gp->exp_depth), gen_aexp(gp->exp_depth));
+  } else if (r < 7) {
+    return pNot(gen_bexp(d - 1));
+  } else {
+    int l = gen_bexp(d - 1);
+    return pAnd(l, gen_bexp(d - 1));
+  }
+}
+
+static int gen_block(int level);
+
+// One statement at nesting level (0 at top level). Compound statements
+// only appear below the depth limit.
+static int gen_stmt(int level) {
+  --budget;
+  uint64_t r = rnd(100);
+  if (level < gp->depth && r < (uint64_t)gp->branch_pct) {
+    int c = gen_bexp(2);
+    int t = gen_block(level + 1);
+    int e = rnd(3) ? gen_block(level + 1) : pSkip();
+    return pIf(c, t, e);
+  }
+  r -= gp->branch_pct;
+  if (level < gp->depth && r < (uint64_t)gp->loop_pct) {
+    // ctr = T; while (!(ctr <= 0) [&& f(..) <= C]) { ... ctr = ctr + -1; }
+    uint64_t ctr = gp->nvars + level;
+    int body = gen_block(level + 1);
+    body = pSeq(body, pAssign(pAdd(pVar(ctr),pCon((uint64_t)-1)),ctr));
+    int cond = pNot(pLe(pVar(ctr),pCon(0)));
+    if (gp->procs > 0 && rnd(100) < (uint64_t)gp->call_pct) {
+      // a call on every test, whose effects the loop optimizer must see
+      cond = pAnd(cond, pLe(gen_call(1), gen_con()));
+    }
+    return pSeq(pAssign(pCon(rnd(gp->trips + 1)),ctr),
+                pWhile(cond, body));
+  }
+  r -= gp->loop_pct;
+  if (r < (uint64_t)gp->print_pct) {
+    return pPrint(gen_aexp(gp->exp_depth));
+  }
+  return pAssign(gen_aexp(gp->exp_depth), rnd(gp->nvars));
+}
+
+// A nested block: a sequence of statements that stops at random, four
+// statements long on average.
+static int gen_block(int level) {
+  int s = gen_stmt(level);
+  if (budget <= 0 || rnd(4) == 0) {
+    return s;
+  }
+  return pSeq(s, gen_block(level));
+}
+
+// Procedure i, with its parameters and body; see the top of the file.
+static void gen_proc(int i) {
+  uint64_t x = param_var(i);
+  proc_params[i] = 1 + rnd(2);
+  int params = pNil();
+  for (int k = proc_params[i] - 1; k >= 0; --k) {
+    params = pCons(pVar(x + k), params);
+  }
+  procs[i] = pProc(params, 0);
+  in_proc = i;
+  in_impure = rnd(3) == 0;
+  int rec = pNil();
+  int rec2 = pNil();
+  if (proc_params[i] == 2) {
+    rec = pCons(gen_aexp(1), rec);
+    rec2 = pCons(gen_aexp(1), rec2);
+  }
+  rec = pCall(procs[i], pCons(pAdd(pVar(x), pCon((uint64_t)-1)), rec));
+  rec2 = pCall(procs[i], pCons(pAdd(pVar(x), pCon((uint64_t)-2)), rec2));
+  int then = pReturn(rnd(2) ? pAdd(rec, rec2) : pAdd(rec, gen_aexp(1)));
+  if (in_impure) {
+    then = pSeq(pAssign(gen_aexp(1), rnd(gp->nvars)), then);
+  }
+  int cond = pAnd(pNot(pLe(pVar(x), pCon(0))), pLe(pVar(x), pCon(gp->bound)));
+  permanent[procs[i]].b = pIf(cond, then, pReturn(gen_aexp(gp->exp_depth)));
+  in_proc = -1;
+}
+
+// Builds a program in the arena and returns its Pgm node. Variables
+// 0 .. nvars-1 hold data and start out at random constants; variables
+// nvars .. nvars+depth-1 are the loop counters, and after them come
+// two parameters per procedure.
+struct node gen_program(const struct gen_params* p) {
+  gp = p;
+  state = p->seed ? p->seed : 88172645463325252ull;
+  budget = p->size;
+  procs = malloc((p->procs + 1) * sizeof(int));
+  proc_params = malloc((p->procs + 1) * sizeof(int));
+  if (!procs || !proc_params) {
+    exit(1);
+  }
+  for (int i = 0; i < p->procs; ++i) {
+    gen_proc(i);
+  }
+  int total = p->nvars + p->depth + 2 * p->procs;
+  int vars = pNil();
+  for (int v = total - 1; v >= 0; --v) {
+    vars = pCons(pVar(v), vars);
+  }
+  // the top level runs until the budget is spent, which can be
+  // millions of statements, so it is chained up without recursion
+  int* top = malloc((budget > 0 ? budget : 1)*sizeof(int));
+  if (!top) {
+    exit(1);
+  }
+  long k = 0;
+  while (budget > 0) {
+    top[k++] = gen_stmt(0);
+  }
+  int body = k ? top[--k] : pSkip();
+  while (k > 0) {
+    body = pSeq(top[--k], body);
+  }
+  free(top);
+  for (int v = p->nvars - 1; v >= 0; --v) {
+    body = pSeq(pAssign(gen_con(), v), body);
+  }
+  return (struct node){Pgm,vars,body,0};
+}
+
+// .imp text, in the layout of sum.imp.
+
+// Binding strength: "/" > "+" > "<=" > "!" > "&&".
+static int prec(struct node n) {
+  switch (n.op) {
+  case Div: return 4;
+  case Add: return 3;
+  case Le: return 2;
+  case Not: return 1;
+  case And: return 0;
+  default: return 5;
+  }
+}
+
+static void print_exp(FILE* out, struct node n, int min) {
+  int p = prec(n);
+  if (p < min) {
+    fputc('(', out);
+  }
+  switch (n.op) {
+  case ACon:
+    fprintf(out, "%"PRIi64, n.immediate);
+    break;
+  case AVar:
+    fprintf(out, "x%"PRIi64, n.immediate);
+    break;
+  case BCon:
+    fputs(n.immediate ? "true" : "false", out);
+    break;
+  case Read:
+    fputs("read()", out);
+    break;
+  case Call:
+  {
+    const char* sep = "";
+    fprintf(out, "p%u(", n.a);
+    for (struct node v = permanent[n.b]; v.op == Cons; v = permanent[v.b]) {
+      fputs(sep, out);
+      print_exp(out, permanent[v.a], 0);
+      sep = ", ";
+    }
+    fputc(')', out);
+    break;
+  }
+  case Div:
+    print_exp(out, permanent[n.a], 4);
+    fputs(" / ", out);
+    print_exp(out, permanent[n.b], 5);
+    break;
+  case Add:
+    print_exp(out, permanent[n.a], 3);
+    fputs(" + ", out);
+    print_exp(out, permanent[n.b], 4);
+    break;
+  case Le:
+    print_exp(out, permanent[n.a], 3);
+    fputs(" <= ", out);
+    print_exp(out, permanent[n.b], 3);
+    break;
+  case Not:
+    fputc('!', out);
+    print_exp(out, permanent[n.a], 5);
+    break;
+  case And:
+    print_exp(out, permanent[n.a], 0);
+    fputs(" && ", out);
+    print_exp(out, permanent[n.b], 1);
+    break;
+  default:
+    fprintf(stderr, "Unknown label %d\n", n.op);
+    exit(3);
+  }
+  if (p < min) {
+    fputc(')', out);
+  }
+}
+
+static void print_stmt(FILE* out, struct node n, int indent);
+
+static void print_block(FILE* out, struct node n, int indent) {
+  if (n.op == Skip) {
+    fputs("{}", out);
+  } else {
+    fputs("{\n", out);
+    print_stmt(out, n, indent + 2);
+    fprintf(out, "%*s}", indent, "");
+  }
+}
+
+static void print_stmt(FILE* out, struct node n, int indent) {
+  while (n.op == Seq) {
+    print_stmt(out, permanent[n.a], indent);
+    n = permanent[n.b];
+  }
+  fprintf(out, "%*s", indent, "");
+  switch (n.op) {
+  case Skip:
+    fputs("{}", out);
+    break;
+  case Assign:
+    fprintf(out, "x%"PRIi64" = ", n.immediate);
+    print_exp(out, permanent[n.a], 0);
+    fputc(';', out);
+    break;
+  case Print:
+    fputs("print(", out);
+    print_exp(out, permanent[n.a], 0);
+    fputs(");", out);
+    break;
+  case Return:
+    fputs("return ", out);
+    print_exp(out, permanent[n.a], 0);
+    fputc(';', out);
+    break;
+  case If:
+    fputs("if (", out);
+    print_exp(out, permanent[n.a], 0);
+    fputs(") ", out);
+    print_block(out, permanent[n.b], indent);
+    fputs(" else ", out);
+    print_block(out, permanent[n.c], indent);
+    break;
+  case While:
+    fputs("while (", out);
+    print_exp(out, permanent[n.a], 0);
+    fputs(") ", out);
+    print_block(out, permanent[n.b], indent);
+    break;
+  default:
+    fprintf(stderr, "Unknown label %d\n", n.op);
+    exit(3);
+  }
+  fputc('\n', out);
+}
+
+// Procedures are not in the program tree (a call refers to one by
+// index), so they are found by scanning the arena, and named p<index>.
+void print_program(FILE* out, struct node pgm) {
+  fputs("int", out);
+  const char* sep = " ";
+  for (struct node v = permanent[pgm.a]; v.op == Cons; v = permanent[v.b]) {
+    fprintf(out, "%sx%"PRIi64, sep, permanent[v.a].immediate);
+    sep = ", ";
+  }
+  fputs(";\n", out);
+  for (struct node* p = permanent; p < permanent_next; ++p) {
+    if (p->op != Proc && p->op != ProcM) {
+      continue;
+    }
+    fprintf(out, "proc p%u(", (uint32_t)(p - permanent));
+    sep = "";
+    for (struct node v = permanent[p->a]; v.op == Cons; v = permanent[v.b]) {
+      fprintf(out, "%sx%"PRIi64, sep, permanent[v.a].immediate);
+      sep = ", ";
+    }
+    fputs(") ", out);
+    print_block(out, permanent[p->b], 0);
+    fputc('\n', out);
+  }
+  print_stmt(out, permanent[pgm.b], 0);
+}
+
+static int ends_with(const char* s, const char* suffix) {
+  size_t n = strlen(s);
+  size_t k = strlen(suffix);
+  return n >= k && !strcmp(s + n - k, suffix);
+}
+
+int main(int argc, char** argv) {
+  struct gen_params p = {1, 100, 3, 4, 4, 20, 10, 10, 0, 0, 10, 10};
+  const char* out = NULL;
+  const char* show = NULL;
+  for (int arg = 1; arg < argc; ++arg) {
+    if (arg + 1 == argc || argv[arg][0] != '-' || strlen(argv[arg]) != 2) {
+      fprintf(stderr, "imp-gen: bad argument %s\n", argv[arg]);
+      return 1;
+    }
+    const char* v = argv[++arg];
+    switch (argv[arg-1][1]) {
+    case 's': p.seed = strtoull(v, NULL, 0); break;
+    case 'n': p.size = atol(v); break;
+    case 'd': p.depth = atoi(v); break;
+    case 'e': p.exp_depth = atoi(v); break;
+    case 'v': p.nvars = atoi(v); break;
+    case 'b': p.branch_pct = atoi(v); break;
+    case 'l': p.loop_pct = atoi(v); break;
+    case 't': p.trips = atoi(v); break;
+    case 'w': p.print_pct = atoi(v); break;
+    case 'f': p.procs = atoi(v); break;
+    case 'c': p.call_pct = atoi(v); break;
+    case 'u': p.bound = atoi(v); break;
+    case 'o': out = v; break;
+    case 'p': show = v; break;
+    default:
+      fprintf(stderr, "imp-gen: unknown option %s\n", argv[arg-1]);
+      return 1;
+    }
+  }
+  if (p.nvars < 1 || p.depth < 0 || p.exp_depth < 0 || p.trips < 0 || p.procs < 0) {
+    fprintf(stderr, "imp-gen: need -v >= 1 and -d, -e, -t, -f >= 0\n");
+    return 1;
+  }
+  initGC();
+  struct node pgm;
+  if (show) {
+    int64_t nvars;
+    if (read_image(show, &pgm, &nvars)) {
+      fprintf(stderr, "imp-gen: cannot read image %s\n", show);
+      return 1;
+    }
+  } else {
+    pgm = gen_program(&p);
+  }
+  if (out && ends_with(out, ".img")) {
+    if (write_image(out, permanent, permanent_next - permanent, pgm)) {
+      fprintf(stderr, "imp-gen: cannot write %s\n", out);
+      return 1;
+    }
+    return 0;
+  }
+  FILE* f = out ? fopen(out, "w") : stdout;
+  if (!f) {
+    fprintf(stderr, "imp-gen: cannot write %s\n", out);
+    return 1;
+  }
+  print_program(f, pgm);
+  return fclose(f) ? 1 : 0;
+}
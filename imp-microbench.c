@@ -0,0 +1,270 @@
+// Per-construct microbenchmarks. Each case runs one construct many
+// times under a backend's own run_k, so the cost of a single rule
+// (a While iteration, an Add, a Div, ...) can be read off directly
+// instead of being inferred from whole programs. The backend is
+// compiled in, so timing covers run_k only, never loading:
+//   cc -O2 -DBACKEND='"imp.c"' imp-microbench.c
+//      terms-c.c loop-opt.c io-c.c config-c.c image-c.c proc-c.c cache-c.c -o bench-imp
+//   cc -O2 -DBACKEND='"imp-big-step.c"' imp-microbench.c
+//      terms-c.c loop-opt.c io-c.c image-c.c -o bench-big-step
+// (add -DHYBRID for imp.c's hybrid mode).
+//
+// Every case wraps a body with k copies of the construct in a counting
+// loop of N iterations and reports
+//   (time(k = K) - time(k = 0)) / (N * K)
+// so the loop itself and everything else the body needs cancel out.
+// Both programs run once to warm up and then R times each, taking
+// turns; the median difference is reported, with the smallest and
+// largest as the spread.
+//
+// Usage: bench [-n N] [-r R] [-O] [-b FILE] [-c FILE] [CASE...]
+//   -n N     loop iterations (1000000)
+//   -r R     timed repetitions (9)
+//   -O       run the loop optimizer (loop-opt.c) on every program
+//   -b FILE  save the results as a baseline
+//   -c FILE  compare against a saved baseline
+// With no CASE, runs all of them.
+
+#include <time.h>
+
+#ifndef BACKEND
+#define BACKEND "imp.c"
+#endif
+
+#define main backend_main
+#include BACKEND
+#undef main
+
+#define BENCH_VARS 4
+
+// Variables: 0 is the loop counter, 1 and 2 hold 7 and 3 (so 1 <= 2 is
+// false), 3 receives results.
+static int mb_program(long iters, int body) {
+  int ctr = pSeq(body, pAssign(pAdd(pVar(0),pCon((uint64_t)-1)),0));
+  return
+    pSeq(pAssign(pCon(7),1),
+    pSeq(pAssign(pCon(3),2),
+    pSeq(pAssign(pCon(iters),0),
+         pWhile(pNot(pLe(pVar(0),pCon(0))), ctr))));
+}
+
+// Each builder returns a loop body with k constructs in it.
+
+// An empty loop: the construct is one iteration, so k scales the trip
+// count instead.
+static long mb_iters;
+
+static int b_while(int k) {
+  return pSkip();
+}
+
+// x3 = x1 + (x1 + (... + x0)), k Adds. The counter at the bottom keeps
+// the loop optimizer from hoisting the whole chain.
+static int b_add(int k) {
+  int e = pVar(0);
+  for (int i = 0; i < k; ++i) {
+    e = pAdd(pVar(1), e);
+  }
+  return pAssign(e, 3);
+}
+
+// x3 = ((x0 / 3) / 3) ... / 3, k Divs.
+static int b_div(int k) {
+  int e = pVar(0);
+  for (int i = 0; i < k; ++i) {
+    e = pDiv(e, pCon(3));
+  }
+  return pAssign(e, 3);
+}
+
+// k Ifs nested in their then branches, each with a condition that
+// holds.
+static int b_if(int k) {
+  int s = pSkip();
+  for (int i = 0; i < k; ++i) {
+    s = pIf(pLe(pVar(2),pVar(1)), s, pSkip());
+  }
+  return s;
+}
+
+// if ((((x1 <= x2) && b) && b) ... && b) {} else {}, k Ands whose left
+// side is false, so every one short-circuits.
+static int b_and(int k) {
+  int c = pLe(pVar(1),pVar(2));
+  for (int i = 0; i < k; ++i) {
+    c = pAnd(c, pLe(pVar(2),pVar(1)));
+  }
+  return pIf(c, pSkip(), pSkip());
+}
+
+// k Seqs of skips.
+static int b_seq(int k) {
+  int s = pSkip();
+  for (int i = 0; i < k; ++i) {
+    s = pSeq(pSkip(), s);
+  }
+  return s;
+}
+
+struct mb_case {
+  const char* name;
+  int (*body)(int k);
+  int k;
+  int scale_iters;
+};
+
+static const struct mb_case cases[] = {
+  {"while_empty", b_while, 16, 1},
+  {"add_chain", b_add, 32, 0},
+  {"div_const", b_div, 16, 0},
+  {"if_nested", b_if, 16, 0},
+  {"and_short", b_and, 16, 0},
+  {"seq_fanout", b_seq, 32, 0},
+};
+#define NCASES (sizeof(cases)/sizeof(cases[0]))
+
+static int mb_optimize;
+static int mb_reps = 9;
+
+static double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void* x, const void* y) {
+  double a = *(const double*)x, b = *(const double*)y;
+  return a < b ? -1 : a > b;
+}
+
+static struct node mb_build(const struct mb_case* c, int k) {
+  long iters = c->scale_iters ? mb_iters * k : mb_iters;
+  int decl = pCons(pVar(0),pCons(pVar(1),pCons(pVar(2),pCons(pVar(3),pNil()))));
+  int body = mb_program(iters, c->body(c->scale_iters ? 0 : k));
+  struct node pgm = (struct node){Pgm,decl,body,0};
+  if (mb_optimize) {
+    optimize_loops(pgm.b);
+  }
+  return pgm;
+}
+
+static double mb_run(struct node pgm) {
+  double t0 = now();
+  run_k(pgm);
+  return now() - t0;
+}
+
+// Times c with k = 0 and k = c->k in alternation, so drift in clock
+// speed hits both alike, and returns the median of the R differences;
+// the smallest and largest go to *lo and *hi.
+static double mb_time(const struct mb_case* c, double* lo, double* hi) {
+  permanent_next = permanent;
+  struct node p0 = mb_build(c, 0);
+  struct node pk = mb_build(c, c->k);
+  double d[64];
+  mb_run(p0);
+  mb_run(pk);
+  for (int r = 0; r < mb_reps; ++r) {
+    double t0 = mb_run(p0);
+    d[r] = mb_run(pk) - t0;
+  }
+  qsort(d, mb_reps, sizeof(double), cmp_double);
+  *lo = d[0];
+  *hi = d[mb_reps-1];
+  return d[mb_reps/2];
+}
+
+struct mb_result {
+  char name[32];
+  double ns;
+};
+
+static int mb_load(const char* path, struct mb_result* out, int max) {
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    return -1;
+  }
+  int n = 0;
+  while (n < max && fscanf(f, "%31s %lf", out[n].name, &out[n].ns) == 2) {
+    ++n;
+  }
+  fclose(f);
+  return n;
+}
+
+int main(int argc, char** argv) {
+  const char* save = NULL;
+  const char* compare = NULL;
+  mb_iters = 1000000;
+  int arg = 1;
+  for (; arg < argc && argv[arg][0] == '-'; ++arg) {
+    if (!strcmp(argv[arg], "-O")) {
+      mb_optimize = 1;
+    } else if (arg + 1 < argc && !strcmp(argv[arg], "-n")) {
+      mb_iters = atol(argv[++arg]);
+    } else if (arg + 1 < argc && !strcmp(argv[arg], "-r")) {
+      mb_reps = atoi(argv[++arg]);
+    } else if (arg + 1 < argc && !strcmp(argv[arg], "-b")) {
+      save = argv[++arg];
+    } else if (arg + 1 < argc && !strcmp(argv[arg], "-c")) {
+      compare = argv[++arg];
+    } else {
+      fprintf(stderr, "unknown option %s\n", argv[arg]);
+      return 1;
+    }
+  }
+  if (mb_reps < 1 || mb_reps > 64 || mb_iters < 1) {
+    fprintf(stderr, "need 1 <= R <= 64 and N >= 1\n");
+    return 1;
+  }
+  struct mb_result base[NCASES];
+  int nbase = 0;
+  if (compare && (nbase = mb_load(compare, base, NCASES)) < 0) {
+    fprintf(stderr, "cannot read baseline %s\n", compare);
+    return 1;
+  }
+  FILE* out = NULL;
+  if (save && !(out = fopen(save, "w"))) {
+    fprintf(stderr, "cannot write baseline %s\n", save);
+    return 1;
+  }
+
+  initGC();
+  vars = calloc(BENCH_VARS, sizeof(int64_t));
+  printf("%s, N=%ld, R=%d%s\n", BACKEND, mb_iters, mb_reps, mb_optimize ? ", -O" : "");
+  printf("%-12s %9s %9s %9s", "case", "ns/op", "min", "max");
+  if (compare) {
+    printf(" %9s %7s", "baseline", "change");
+  }
+  printf("\n");
+  for (size_t i = 0; i < NCASES; ++i) {
+    const struct mb_case* c = &cases[i];
+    int wanted = arg == argc;
+    for (int a = arg; a < argc; ++a) {
+      wanted |= !strcmp(argv[a], c->name);
+    }
+    if (!wanted) {
+      continue;
+    }
+    double lo, hi;
+    double t = mb_time(c, &lo, &hi);
+    double ops = (double)mb_iters * c->k;
+    double ns = t / ops * 1e9;
+    printf("%-12s %9.2f %9.2f %9.2f", c->name, ns, lo / ops * 1e9, hi / ops * 1e9);
+    if (compare) {
+      for (int b = 0; b < nbase; ++b) {
+        if (!strcmp(base[b].name, c->name)) {
+          printf(" %9.2f %+6.1f%%", base[b].ns, (ns - base[b].ns) / base[b].ns * 100);
+        }
+      }
+    }
+    printf("\n");
+    if (out) {
+      fprintf(out, "%s %.4f\n", c->name, ns);
+    }
+  }
+  if (out) {
+    fclose(out);
+  }
+  return 0;
+}
@@ -0,0 +1,357 @@
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Runs one program over several inputs at once: every variable holds
+// one value per lane, and control flow is handled by masking lanes
+// off, the same way IfC/WhileC pick a branch in imp.c.
+//   gcc -O2 -march=native imp-simd.c terms-c.c image-c.c
+//   ./a.out 10 100 1000 ...
+#if defined(__AVX512F__)
+#define LANES 8
+#elif defined(__AVX2__)
+#define LANES 4
+#else
+#define LANES 1
+#endif
+
+typedef int64_t lanes __attribute__((vector_size(LANES*sizeof(int64_t))));
+
+// 16 bytes. Good.
+struct node {
+  uint32_t op;
+  uint32_t a;
+  union {
+    struct {
+      uint32_t b;
+      uint32_t c;
+    };
+    int64_t immediate;
+  };
+};
+
+extern struct node mkNullary(uint32_t opcode);
+extern struct node mkImm(uint32_t opcode, uint64_t imm);
+extern struct node mkUnary(uint32_t opcode, uint32_t a);
+extern struct node mkUnaryImm(uint32_t opcode, uint32_t a, uint64_t imm);
+extern struct node mkBinary(uint32_t opcode, uint32_t a, uint32_t b);
+extern struct node mkTernary(uint32_t opcode, uint32_t a, uint32_t b, uint32_t c);
+
+#define Op1(Ix) 16  +Ix
+#define Op2(Ix) 16*2+Ix
+#define Op3(Ix) 16*3+Ix
+
+enum OpCode {
+  // nullary
+  ACon = 0,
+  AVar = 1,
+  BCon = 2,
+  // nullary stack-only
+  DivR = 3,
+  AddR = 4,
+  LeR = 5,
+  NotF = 6,
+  AssignR = 7,
+  Skip = 8,
+  Nil = 9,
+
+  // unary
+  Not = Op1(0),
+  Assign = Op1(1),
+  // unary stack-only
+  DivL = Op1(2),
+  AddL = Op1(3),
+  LeL = Op1(4),
+  AndL = Op1(5),
+  Pgm = Op1(6),
+  Ind = Op1(7),
+
+  // binary
+  Div = Op2(0),
+  Add = Op2(1),
+  Le = Op2(2),
+  And = Op2(3),
+  While = Op2(4),
+  Seq = Op2(5),
+  Cons = Op2(6),
+  // stack only
+  WhileC = Op2(7),
+  IfC = Op2(8),
+
+  // ternary
+  If = Op3(0),
+};
+
+struct node* permanent;
+struct node* permanent_top;
+struct node* permanent_next;
+
+void initGC() {
+  permanent = aligned_alloc(0x10,2048*sizeof(struct node));
+  permanent_top = permanent + 2048;
+  permanent_next = permanent;
+}
+
+// One slot per variable id, sized by main once the program is loaded.
+lanes* vars;
+// Lanes that got stuck (divide by zero). They stay masked off for the
+// rest of the run, so their vars keep the values they had when stuck.
+lanes stuck;
+
+static inline int any(lanes m) {
+  int64_t r = 0;
+  for (int i = 0; i < LANES; ++i) {
+    r |= m[i];
+  }
+  return r != 0;
+}
+
+static inline lanes splat(int64_t x) {
+  lanes v;
+  for (int i = 0; i < LANES; ++i) {
+    v[i] = x;
+  }
+  return v;
+}
+
+// Lanes outside the mask compute garbage, which is never stored.
+lanes aeval(struct node top, lanes m) {
+  switch(top.op) {
+  case ACon:
+    return splat(top.immediate);
+  case AVar:
+    return vars[top.immediate];
+  case Add:
+    return aeval(permanent[top.a], m) + aeval(permanent[top.b], m);
+  case Div:
+  {
+    lanes n = aeval(permanent[top.a], m);
+    lanes d = aeval(permanent[top.b], m);
+    lanes zero = (d == 0);
+    stuck |= m & zero;
+    // divide by 1 in every lane that is not live, so neither a zero nor
+    // INT64_MIN / -1 left over in a masked-off lane can trap
+    lanes live = m & ~zero;
+    return n / ((d & live) | (splat(1) & ~live));
+  }
+  default:
+    printf("Unknown label %d\n", top.op);
+    exit(3);
+  }
+}
+
+lanes beval(struct node top, lanes m) {
+  switch(top.op) {
+  case BCon:
+    return splat(top.immediate ? -1 : 0);
+  case Not:
+    return ~beval(permanent[top.a], m);
+  case And:
+  {
+    lanes l = beval(permanent[top.a], m);
+    // only lanes where the left side held evaluate the right side
+    return l & beval(permanent[top.b], m & l & ~stuck);
+  }
+  case Le:
+  {
+    lanes l = aeval(permanent[top.a], m);
+    return l <= aeval(permanent[top.b], m);
+  }
+  default:
+    printf("Unknown label %d\n", top.op);
+    exit(3);
+  }
+}
+
+void exec(struct node top, lanes m) {
+  switch(top.op) {
+  case Skip:
+    break;
+  case Seq:
+    exec(permanent[top.a], m);
+    exec(permanent[top.b], m & ~stuck);
+    break;
+  case If:
+  {
+    lanes c = beval(permanent[top.a], m);
+    m &= ~stuck;
+    if (any(m & c)) {
+      exec(permanent[top.b], m & c);
+    }
+    if (any(m & ~c)) {
+      exec(permanent[top.c], m & ~c);
+    }
+    break;
+  }
+  case While:
+  {
+    struct node condition = permanent[top.a];
+    struct node body = permanent[top.b];
+    // lanes retire from the loop as soon as their condition fails
+    for (;;) {
+      m &= beval(condition, m) & ~stuck;
+      if (!any(m)) {
+        break;
+      }
+      exec(body, m);
+      m &= ~stuck;
+    }
+    break;
+  }
+  case Assign:
+  {
+    lanes x = aeval(permanent[top.a], m);
+    m &= ~stuck;
+    vars[top.immediate] = (x & m) | (vars[top.immediate] & ~m);
+    break;
+  }
+  default:
+    printf("Unknown label %d\n", top.op);
+    exit(3);
+  }
+}
+
+// Lanes start from the given initial values instead of the zeros the
+// declaration would assign; everything else follows the Pgm node.
+void run_k(struct node top, lanes init[]) {
+  struct node varList = permanent[top.a];
+  struct node body = permanent[top.b];
+  while (varList.op != Nil) {
+    int64_t v = permanent[varList.a].immediate;
+    vars[v] = init[v];
+    varList = permanent[varList.b];
+  }
+  stuck = splat(0);
+  exec(body, splat(-1));
+}
+
+int perm(struct node n) {
+  if (permanent_next == permanent_top) {
+    // everything refers to permanent by index, so it can move
+    long size = permanent_top - permanent;
+    permanent = realloc(permanent, 2*size*sizeof(struct node));
+    if (!permanent) {
+      exit(1);
+    }
+    permanent_next = permanent + size;
+    permanent_top = permanent + 2*size;
+  }
+  *permanent_next = n;
+  return permanent_next++ - permanent;
+}
+
+int pCons(int l,int r) {
+  return perm(mkBinary(Cons,l,r));
+}
+int pNil() {
+  return perm(mkNullary(Nil));
+}
+int pVar(uint64_t id) {
+  return perm(mkImm(AVar,id));
+}
+int pCon(uint64_t val) {
+  return perm(mkImm(ACon,val));
+}
+int pSeq(int l, int r) {
+  return perm(mkBinary(Seq,l,r));
+}
+int pAssign(int exp, uint64_t id) {
+  return perm(mkUnaryImm(Assign,exp,id));
+}
+int pWhile(int cond, int body) {
+  return perm(mkBinary(While,cond,body));
+}
+int pNot(int a) {
+  return perm(mkUnary(Not,a));
+}
+int pAdd(int a, int b) {
+  return perm(mkBinary(Add,a,b));
+}
+int pLe(int a, int b) {
+  return perm(mkBinary(Le,a,b));
+}
+
+// load_sum without the "n = N;" statement: n comes in per lane.
+struct node load_sum() {
+  int vars = pCons(pVar(0),pCons(pVar(1),pNil()));
+  int body =
+    pSeq(pAssign(pCon(0),1),
+         pWhile(pNot(pLe(pVar(0),pCon(0))),
+                pSeq(pAssign(pAdd(pVar(1),pVar(0)),1),
+                     pAssign(pAdd(pVar(0),pCon((uint64_t)-1)),0))));
+  return (struct node){Pgm,vars,body,0};
+}
+
+// Program images, see image-c.c.
+extern int read_image(const char* path, struct node* root, int64_t* nvars);
+extern void print_image_state(const char* tag, uint32_t var_list, const int64_t* vars);
+
+static lanes* alloc_lanes(int64_t n) {
+  lanes* v = aligned_alloc(sizeof(lanes), n * sizeof(lanes));
+  if (!v) {
+    exit(1);
+  }
+  return v;
+}
+
+// Usage: imp-simd N...
+//        imp-simd -i FILE [N...]
+//   -i  run the program image in FILE (see imp-gen.c) and print every
+//       variable instead of n and sum. Each N is the initial value of
+//       the first declared variable in one lane; without any, the
+//       image runs once from zeros, like on the other backends, and
+//       exits with status 2 if it gets stuck.
+int main(int argc, char** argv) {
+  initGC();
+  struct node pgm;
+  int64_t nvars = 2;
+  int from_image = argc > 2 && !strcmp(argv[1], "-i");
+  int first = 1;
+  if (from_image) {
+    if (read_image(argv[2], &pgm, &nvars)) {
+      fprintf(stderr, "imp-simd: cannot read image %s\n", argv[2]);
+      return 1;
+    }
+    first = 3;
+  } else {
+    pgm = load_sum();
+  }
+  vars = alloc_lanes(nvars);
+  lanes* init = alloc_lanes(nvars);
+  int64_t* state = malloc(nvars * sizeof(int64_t));
+  if (!state) {
+    exit(1);
+  }
+  // the variable each N seeds, if the program declares any
+  int64_t seeded = permanent[pgm.a].op == Cons ? permanent[permanent[pgm.a].a].immediate : -1;
+  int status = 0;
+  // inputs are consumed LANES at a time; a short last batch repeats
+  // its final input in the unused lanes
+  int runs = from_image && first == argc ? 1 : argc - first;
+  for (int i = 0; i < runs; i += LANES) {
+    for (int64_t v = 0; v < nvars; ++v) {
+      init[v] = splat(0);
+    }
+    for (int l = 0; l < LANES && seeded >= 0 && first < argc; ++l) {
+      int k = first + (i + l < runs ? i + l : runs - 1);
+      init[seeded][l] = atol(argv[k]);
+    }
+    run_k(pgm, init);
+    for (int l = 0; l < LANES && i + l < runs; ++l) {
+      if (from_image) {
+        for (int64_t v = 0; v < nvars; ++v) {
+          state[v] = vars[v][l];
+        }
+        print_image_state(stuck[l] ? "Stuck." : "Done.", pgm.a, state);
+        status |= stuck[l] ? 2 : 0;
+      } else if (stuck[l]) {
+        printf("Stuck.\n");
+      } else {
+        printf("Done. n=%"PRIi64" sum=%"PRIi64"\n",vars[0][l],vars[1][l]);
+      }
+    }
+  }
+  return status;
+}
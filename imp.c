@@ -2,6 +2,11 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 // 16 bytes. Good.
 struct node {
@@ -40,6 +45,15 @@ enum OpCode {
   AssignR = 7,
   Skip = 8,
   Nil = 9,
+  // nullary loop-optimizer forms, see loop-opt.c; a and b are
+  // variables, not children
+  Inc = 10,
+  LeVC = 11,
+  GtVC = 12,
+  LeVV = 13,
+  GtVV = 14,
+  // read()
+  Read = 15,
 
   // unary
   Not = Op1(0),
@@ -51,6 +65,20 @@ enum OpCode {
   AndL = Op1(5),
   Pgm = Op1(6),
   Ind = Op1(7),
+  // loop-invariant expression and the frame that caches its value
+  Inv = Op1(8),
+  InvR = Op1(9),
+  Print = Op1(10),
+  // stack-only
+  PrintR = Op1(11),
+  // procedures, see proc-c.c
+  Return = Op1(12),
+  // stack-only: return's value, the call frame (a the Proc, b its
+  // parameter count, c set when memoizing) and a parameter's saved
+  // value (a the variable)
+  ReturnR = Op1(13),
+  Ret = Op1(14),
+  Save = Op1(15),
 
   // binary
   Div = Op2(0),
@@ -63,6 +91,19 @@ enum OpCode {
   // stack only
   WhileC = Op2(7),
   IfC = Op2(8),
+  // While with Inv nodes inside; c is the loop id
+  WhileI = Op2(9),
+  // a parameter list, b body, c parameter count (set by
+  // prepare_procs)
+  Proc = Op2(10),
+  // a the Proc (a reference, not a child), b the argument list
+  Call = Op2(11),
+  // stack only: evaluating an argument (a the rest of the argument
+  // list, b the Proc) and an evaluated one
+  ArgK = Op2(12),
+  ArgV = Op2(13),
+  // Proc proved pure, whose calls go through the memo table
+  ProcM = Op2(14),
 
   // ternary
   If = Op3(0),
@@ -80,6 +121,12 @@ const char* opnames[64] =
     [7]      = "AssignR %4$ld",
     [8]      = "Skip",
     [9]      = "Nil",
+    [10]     = "Inc v%1$d %4$ld",
+    [11]     = "LeVC v%1$d %4$ld",
+    [12]     = "GtVC v%1$d %4$ld",
+    [13]     = "LeVV v%1$d v%2$d",
+    [14]     = "GtVV v%1$d v%2$d",
+    [15]     = "Read",
     [Op1(0)] = "Not %d",
     [Op1(1)] = "Assign v%4$ld %1$d",
     [Op1(2)] = "DivL %d",
@@ -88,6 +135,14 @@ const char* opnames[64] =
     [Op1(5)] = "AndL %d",
     [Op1(6)] = "Pgm %d %d",
     [Op1(7)] = "Ind %d",
+    [Op1(8)] = "Inv %d",
+    [Op1(9)] = "InvR",
+    [Op1(10)] = "Print %d",
+    [Op1(11)] = "PrintR",
+    [Op1(12)] = "Return %d",
+    [Op1(13)] = "ReturnR",
+    [Op1(14)] = "Ret %d %d %d",
+    [Op1(15)] = "Save v%1$d %4$ld",
     [Op2(0)] = "Div %d %d",
     [Op2(1)] = "Add %d %d",
     [Op2(2)] = "Le %d %d",
@@ -97,6 +152,12 @@ const char* opnames[64] =
     [Op2(6)] = "Cons %d %d",
     [Op2(7)] = "WhileC %d %d",
     [Op2(8)] = "IfC %d %d",
+    [Op2(9)] = "WhileI %d %d %d",
+    [Op2(10)] = "Proc %d %d %d",
+    [Op2(11)] = "Call %d %d",
+    [Op2(12)] = "ArgK %d %d",
+    [Op2(13)] = "ArgV %4$ld",
+    [Op2(14)] = "ProcM %d %d %d",
     [Op3(0)] = "If %d %d %d",
   };
 
@@ -115,6 +176,10 @@ void dump_seg(const char* prefix, struct node* base, struct node* end, const cha
 struct node* stack;
 struct node* stack_base;
 struct node* stack_top;
+// Lowest committed frame. Everything between stack_base and here is
+// reserved but PROT_NONE, so running into it faults instead of
+// scribbling over whatever sits below the stack.
+struct node* stack_committed;
 
 struct node* permanent;
 struct node* permanent_top;
@@ -124,24 +189,275 @@ struct node* heap_base;
 struct node* heap_top;
 struct node* heap;
 
+#ifdef HYBRID
+// safe[i] is set when permanent[i] is an expression that cannot get
+// stuck, so run_k may evaluate it in one go instead of through the
+// continuation stack.
+uint8_t* safe;
+#endif
+
+#define STACK_RESERVE 0x40000000 // 1GB of address space, 64M frames
+#define STACK_CHUNK   0x10000    // committed 64KB at a time
+#define PAGE_SIZE     0x1000
+
+// Pushes stay a plain decrement: running off the committed part of the
+// stack faults on the guard below it, and the handler commits the next
+// chunk and lets the store retry. Only the lowest page of the
+// reservation is never committed; reaching it is a real overflow.
+void stack_fault(int sig, siginfo_t* info, void* context) {
+  char* addr = info->si_addr;
+  char* low = (char*)stack_base;
+  char* committed = (char*)stack_committed;
+  if (addr < low || addr >= committed) {
+    // not ours, let it crash normally
+    signal(SIGSEGV, SIG_DFL);
+    return;
+  }
+  if (addr < low + PAGE_SIZE) {
+    static const char msg[] = "Stack overflow\n";
+    write(2, msg, sizeof(msg)-1);
+    _exit(4);
+  }
+  char* next = committed - STACK_CHUNK;
+  while (next > addr) {
+    next -= STACK_CHUNK;
+  }
+  if (next < low + PAGE_SIZE) {
+    next = low + PAGE_SIZE;
+  }
+  if (mprotect(next, committed - next, PROT_READ|PROT_WRITE)) {
+    _exit(1);
+  }
+  stack_committed = (struct node*)next;
+}
+
+// Deepest point the stack reached, in frames. Untouched pages read as
+// zero and no pushed frame has op 0, so the first nonzero frame from
+// the bottom of the committed part marks the high-water mark.
+long stack_high_water() {
+  struct node* p = stack_committed;
+  while (p < stack_top && p->op == 0) {
+    ++p;
+  }
+  return stack_top - p;
+}
+
 void initGC() {
-  stack_base = aligned_alloc(0x1000000,0x1000000); // 1MB stack
-  if (!stack_base) {
+  stack_base = mmap(NULL, STACK_RESERVE, PROT_NONE,
+                    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if (stack_base == MAP_FAILED) {
     exit(1);
   }
-  stack_top = stack_base + 0x100000;
+  stack_committed = (struct node*)((char*)stack_base + STACK_RESERVE - STACK_CHUNK);
+  if (mprotect(stack_committed, STACK_CHUNK, PROT_READ|PROT_WRITE)) {
+    exit(1);
+  }
+  // The frame at stack_top stays zero, so peeking at an empty stack
+  // reads an op no frame handler matches.
+  stack_top = (struct node*)((char*)stack_base + STACK_RESERVE) - 1;
   stack = stack_top;
 
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = stack_fault;
+  sa.sa_flags = SA_SIGINFO;
+  sigaction(SIGSEGV, &sa, NULL);
+
   permanent = aligned_alloc(0x10,2048*sizeof(struct node));
   permanent_top = permanent + 2048;
   permanent_next = permanent;
+#ifdef HYBRID
+  safe = malloc(2048);
+#endif
 }
 
 void push_node(struct node n) {
   *--stack = n;
 }
 
-int64_t vars[2];
+// One slot per variable id, sized by main once the program is loaded.
+int64_t* vars;
+
+// Loop-optimizer state, see loop-opt.c.
+struct inv_slot {
+  int64_t epoch;
+  int64_t value;
+};
+extern int64_t epoch;
+extern int64_t* loop_epoch;
+extern struct inv_slot* inv_slots;
+extern void optimize_loops(uint32_t body);
+
+// Buffered streams behind read() and print(), see io-c.c.
+extern void io_init();
+extern void io_flush();
+extern int io_read_int(int64_t* out);
+extern void io_print_int(int64_t x);
+
+// Program images, see image-c.c.
+extern int read_image(const char* path, struct node* root, int64_t* nvars);
+extern void print_image_state(const char* tag, uint32_t var_list, const int64_t* vars);
+
+// Final-configuration serializer, see config-c.c.
+extern void dump_config(struct node* redex, struct node* stack, struct node* stack_top,
+                        uint32_t var_list, int64_t* vars,
+                        const char** var_names, int64_t var_name_count, int exit_code);
+
+// Procedures and the memo table for pure ones, see proc-c.c.
+extern int64_t prepare_procs(struct node pgm, int memo);
+extern void memo_init(uint32_t n);
+extern int memo_lookup(uint32_t proc, const struct node* args, uint32_t n, int64_t* out);
+extern void memo_store(uint32_t proc, const struct node* args, uint32_t n, int64_t value);
+extern int64_t memo_hits;
+extern int64_t memo_misses;
+extern int64_t memo_evictions;
+
+// Cross-run result cache, see cache-c.c.
+extern int cache_open(const char* path);
+extern int cache_key(struct node pgm, const int64_t* vars, int64_t nvars);
+extern int cache_lookup(int64_t* vars, int* status);
+extern void cache_store(const int64_t* vars, int status);
+
+#ifdef PROFILE
+// Sampling profiler, see prof-c.c. The SIGPROF handler reads the
+// continuation from stack, so run_k needs no hooks.
+extern void prof_start();
+extern void prof_stop();
+extern void prof_report(FILE* out, const char* folded);
+// Set by -p: where the folded stacks go.
+const char* prof_folded;
+#endif
+
+// Set by -c: print the configuration as krun would, on success and
+// when stuck, instead of the Done line.
+int dump_on_exit;
+uint32_t pgm_vars;
+const char* var_names[] = {"n", "sum", "k"};
+int64_t var_name_count = 3;
+// Set by -i: the program came from an image, so the final state is
+// printed by print_image_state, also when stuck.
+int from_image;
+
+int pCon(uint64_t val);
+
+// Set when this run's result goes into the cache (-C).
+int cache_pending;
+
+// Called where the machine gets stuck, with the redex it is stuck on;
+// the rest of the continuation is still on the stack.
+void stuck(struct node redex) {
+  if (dump_on_exit) {
+    // unwritten output goes in the <out> cell
+    dump_config(&redex, stack, stack_top, pgm_vars, vars, var_names, var_name_count, 2);
+  } else if (from_image) {
+    io_flush();
+    print_image_state("Stuck.", pgm_vars, vars);
+  }
+  if (cache_pending) {
+    cache_store(vars, 2);
+  }
+#ifdef PROFILE
+  prof_stop();
+  prof_report(stderr, prof_folded);
+#endif
+  exit(2);
+}
+
+#ifdef HYBRID
+// Direct evaluation in the style of imp-big-step.c, only ever applied
+// to subtrees marked safe.
+int64_t aeval(struct node top) {
+  switch(top.op) {
+  case ACon:
+    return top.immediate;
+  case AVar:
+    return vars[top.immediate];
+  case Add:
+    return aeval(permanent[top.a]) + aeval(permanent[top.b]);
+  case Div:
+    return aeval(permanent[top.a]) / permanent[top.b].immediate;
+  case Inv:
+  {
+    struct inv_slot* slot = &inv_slots[(uint32_t)top.immediate];
+    int64_t e = loop_epoch[top.immediate >> 32];
+    if (slot->epoch != e) {
+      slot->value = aeval(permanent[top.a]);
+      slot->epoch = e;
+    }
+    return slot->value;
+  }
+  default:
+    printf("Unknown label %d\n", top.op);
+    exit(3);
+  }
+}
+
+int64_t beval(struct node top) {
+  switch(top.op) {
+  case BCon:
+    return top.immediate;
+  case Not:
+    return !beval(permanent[top.a]);
+  case And:
+    return beval(permanent[top.a]) && beval(permanent[top.b]);
+  case Le:
+    return aeval(permanent[top.a]) <= aeval(permanent[top.b]);
+  case LeVC:
+    return vars[top.a] <= top.immediate;
+  case GtVC:
+    return vars[top.a] > top.immediate;
+  case LeVV:
+    return vars[top.a] <= vars[top.b];
+  case GtVV:
+    return vars[top.a] > vars[top.b];
+  default:
+    printf("Unknown label %d\n", top.op);
+    exit(3);
+  }
+}
+
+// An expression is safe when nothing in it can divide by zero. ix is
+// where n goes in permanent: only children before it have been marked
+// (read_image lets a Proc's body come after the Proc), so any other
+// child counts as unsafe.
+uint8_t is_safe(struct node n, uint32_t ix) {
+  switch (n.op >> 4) {
+  case 3:
+    if (n.c >= ix) {
+      return 0;
+    }
+  case 2:
+    if (n.b >= ix) {
+      return 0;
+    }
+  case 1:
+    if (n.a >= ix) {
+      return 0;
+    }
+  }
+  switch(n.op) {
+  case ACon:
+  case AVar:
+  case BCon:
+  case LeVC:
+  case GtVC:
+  case LeVV:
+  case GtVV:
+    return 1;
+  case Not:
+  case Inv:
+    return safe[n.a];
+  case Add:
+  case Le:
+  case And:
+    return safe[n.a] && safe[n.b];
+  case Div:
+    return safe[n.a] && permanent[n.b].op == ACon && permanent[n.b].immediate != 0;
+  default:
+    return 0;
+  }
+}
+#endif
 
 void run_k(struct node top) {
   int64_t acon_val, bcon_val;
@@ -176,12 +492,57 @@ printf("Stack: ");dump_seg("",stack, stack_top, " ~> ");puts("");
     case Assign:
       assign_var = top.immediate;
       opl = top.a;
+#ifdef HYBRID
+      if (safe[opl]) {
+        vars[assign_var] = aeval(permanent[opl]);
+        goto next_stmt;
+      }
+#endif
       top = permanent[opl];
       goto assign;
     case Ind:
       top = heap[top.a];
       goto stmt;
+    case Inc:
+      vars[top.a] += top.immediate;
+      goto next_stmt;
+    case Print:
+      top = permanent[top.a];
+      if (top.op == ACon) {
+        io_print_int(top.immediate);
+        goto next_stmt;
+      }
+      push_node(mkNullary(PrintR));
+      goto aexp_nonval;
+    case Return:
+      top = permanent[top.a];
+      if (top.op == ACon) {
+        acon_val = top.immediate;
+        goto unwind;
+      }
+      push_node(mkNullary(ReturnR));
+      goto aexp_nonval;
+    case Ret:
+      // the body ran to its end without a return
+      acon_val = 0;
+      goto ret;
+    case WhileI:
+      // entering the loop; later iterations come back as While
+      loop_epoch[top.c] = ++epoch;
+      top.op = While;
+      // fall through
     case While:
+#ifdef HYBRID
+      if (safe[top.a]) {
+        if (beval(permanent[top.a])) {
+          push_node(top);
+          top = permanent[top.b];
+          goto stmt;
+        } else {
+          goto next_stmt;
+        }
+      }
+#endif
       push_node(mkBinary(WhileC,top.a,top.b));
       top = permanent[top.a];
       goto while_op;
@@ -191,6 +552,12 @@ printf("Stack: ");dump_seg("",stack, stack_top, " ~> ");puts("");
       top = permanent[opl];
       goto stmt;
     case If:
+#ifdef HYBRID
+      if (safe[top.a]) {
+        top = permanent[beval(permanent[top.a]) ? top.b : top.c];
+        goto stmt;
+      }
+#endif
       opr = top.b;
       op3 = top.c;
       top = permanent[top.a];
@@ -234,12 +601,48 @@ printf("Stack: ");dump_seg("",stack, stack_top, " ~> ");puts("");
       goto acon;
     case Div:
       opr = top.b;
+#ifdef HYBRID
+      if (safe[top.a]) {
+        acon_val = aeval(permanent[top.a]);
+        top = permanent[opr];
+        goto div_r;
+      }
+#endif
       top = permanent[top.a];
       goto div;
     case Add:
       opr = top.b;
+#ifdef HYBRID
+      if (safe[top.a]) {
+        acon_val = aeval(permanent[top.a]);
+        top = permanent[opr];
+        goto add_r;
+      }
+#endif
       top = permanent[top.a];
       goto add;
+    case Read:
+      if (!io_read_int(&acon_val)) {
+        stuck(top);
+      }
+      goto acon;
+    case Inv:
+      if (inv_slots[(uint32_t)top.immediate].epoch == loop_epoch[top.immediate >> 32]) {
+        acon_val = inv_slots[(uint32_t)top.immediate].value;
+        goto acon;
+      }
+      push_node(mkImm(InvR,top.immediate));
+      top = permanent[top.a];
+      goto aexp;
+    case Call:
+      opl = top.a;
+      top = permanent[top.b];
+      if (top.op == Nil) {
+        goto call;
+      }
+      push_node(mkBinary(ArgK,top.b,opl));
+      top = permanent[top.a];
+      goto aexp;
     }
   }
  bexp:
@@ -263,12 +666,37 @@ printf("Stack: ");dump_seg("",stack, stack_top, " ~> ");puts("");
       goto not;
     case Le:
       opr = top.b;
+#ifdef HYBRID
+      if (safe[top.a]) {
+        acon_val = aeval(permanent[top.a]);
+        top = permanent[opr];
+        goto le_r;
+      }
+#endif
       top = permanent[top.a];
       goto le;
     case And:
       opr = top.b;
+#ifdef HYBRID
+      if (safe[top.a]) {
+        bcon_val = beval(permanent[top.a]);
+        goto and_exec;
+      }
+#endif
       top = permanent[top.a];
       goto and;
+    case LeVC:
+      bcon_val = vars[top.a] <= top.immediate;
+      goto bcon;
+    case GtVC:
+      bcon_val = vars[top.a] > top.immediate;
+      goto bcon;
+    case LeVV:
+      bcon_val = vars[top.a] <= vars[top.b];
+      goto bcon;
+    case GtVV:
+      bcon_val = vars[top.a] > vars[top.b];
+      goto bcon;
     }
   }
  acon:
@@ -278,7 +706,9 @@ printf("Stack: ");dump_seg("",stack, stack_top, " ~> ");puts("");
     switch(stack->op) {
     case DivR:
       if (acon_val == 0) {
-        exit(2);
+        int64_t l = stack->immediate;
+        ++stack;
+        stuck(mkBinary(Div,pCon(l),pCon(0)));
       } else {
         acon_val = stack->immediate / acon_val;
         ++stack;
@@ -296,15 +726,51 @@ printf("Stack: ");dump_seg("",stack, stack_top, " ~> ");puts("");
       vars[stack->immediate] = acon_val;
       ++stack;
       goto next_stmt;
+    case PrintR:
+      io_print_int(acon_val);
+      ++stack;
+      goto next_stmt;
+    case ReturnR:
+      ++stack;
+      goto unwind;
+    case ArgK:
+      opl = stack->b;
+      top = permanent[stack->a];
+      *stack = (struct node){ArgV,0,.immediate=acon_val};
+      if (top.op == Nil) {
+        goto call;
+      }
+      push_node(mkBinary(ArgK,top.b,opl));
+      top = permanent[top.a];
+      goto aexp;
+    case InvR:
+      inv_slots[(uint32_t)stack->immediate].value = acon_val;
+      inv_slots[(uint32_t)stack->immediate].epoch = loop_epoch[stack->immediate >> 32];
+      ++stack;
+      goto acon;
     case DivL:
       top = permanent[stack->a];
       ++stack;
       goto div_r;
     case AddL:
+#ifdef HYBRID
+      if (safe[stack->a]) {
+        acon_val = acon_val + aeval(permanent[stack->a]);
+        ++stack;
+        goto acon;
+      }
+#endif
       top = permanent[stack->a];
       ++stack;
       goto add_r;
     case LeL:
+#ifdef HYBRID
+      if (safe[stack->a]) {
+        bcon_val = acon_val <= aeval(permanent[stack->a]);
+        ++stack;
+        goto bcon;
+      }
+#endif
       top = permanent[stack->a];
       ++stack;
       goto le_r;
@@ -352,16 +818,14 @@ printf("Stack: ");dump_seg("",stack, stack_top, " ~> ");puts("");
       goto bexp_nonval;
     }
   }
- div:
+ div: // left arg loaded in top, right index in opr
   {
-    int r = top.b;
-    top = permanent[top.a];
     if (top.op == ACon) {
-      opl = top.immediate;
-      top = permanent[r];
+      acon_val = top.immediate;
+      top = permanent[opr];
       goto div_r;
     } else {
-      push_node(mkUnary(DivL,r));
+      push_node(mkUnary(DivL,opr));
       goto aexp_nonval;
     }
   }
@@ -369,7 +833,7 @@ printf("Stack: ");dump_seg("",stack, stack_top, " ~> ");puts("");
   {
     if (top.op == ACon) {
       if (top.immediate == 0) {
-        exit(2);
+        stuck(mkBinary(Div,pCon(acon_val),pCon(0)));
       } else {
         acon_val = acon_val / top.immediate;
         goto acon;
@@ -427,20 +891,24 @@ printf("Stack: ");dump_seg("",stack, stack_top, " ~> ");puts("");
       goto aexp_nonval;
     }
   }
- and:
+ and: // left arg loaded in top, right index in opr
   {
-    opr = top.b;
-    top = permanent[top.a];
     if (top.op == BCon) {
       bcon_val = top.immediate;
       goto and_exec;
     } else {
-      push_node(mkUnary(LeL,opr));
+      push_node(mkUnary(AndL,opr));
       goto bexp_nonval;
     }
   }
  and_exec:
   {
+#ifdef HYBRID
+    if (bcon_val && safe[opr]) {
+      bcon_val = beval(permanent[opr]);
+      goto bcon;
+    }
+#endif
     if (bcon_val) {
       top = permanent[opr];
       goto bexp;
@@ -467,11 +935,8 @@ printf("Stack: ");dump_seg("",stack, stack_top, " ~> ");puts("");
       goto bexp_nonval;
     }
   }
- if_op:
+ if_op: // condition loaded in top, branch indices in opr and op3
   {
-    opr = top.b;
-    op3 = top.c;
-    top = permanent[top.a];
     if (top.op == BCon) {
       if (top.immediate) {
         top = permanent[opr];
@@ -484,6 +949,54 @@ printf("Stack: ");dump_seg("",stack, stack_top, " ~> ");puts("");
       goto bexp_nonval;
     }
   }
+ call: // the Proc in opl, the values of its arguments on the stack
+  {
+    struct node p = permanent[opl];
+    uint32_t n = p.c;
+    // args[n-1] is the first argument
+    struct node* args = stack;
+    if (p.op == ProcM && memo_lookup(opl, args, n, &acon_val)) {
+      stack += n;
+      goto acon;
+    }
+    for (struct node v = permanent[p.a]; v.op == Cons; v = permanent[v.b]) {
+      uint32_t x = permanent[v.a].immediate;
+      int64_t val = args[--n].immediate;
+      if (p.op == ProcM) {
+        // the argument frames stay below the call as the key to store
+        // the result under
+        push_node((struct node){Save,x,.immediate=vars[x]});
+      } else {
+        args[n] = (struct node){Save,x,.immediate=vars[x]};
+      }
+      vars[x] = val;
+    }
+    push_node(mkTernary(Ret,opl,p.c,p.op == ProcM));
+    top = permanent[p.b];
+    goto stmt;
+  }
+ unwind: // return with the value in acon_val: drop the rest of the body
+  {
+    while (stack < stack_top && stack->op != Ret) {
+      ++stack;
+    }
+    if (stack == stack_top) {
+      stuck(mkUnary(Return,pCon(acon_val)));
+    }
+    top = *stack++;
+    goto ret;
+  }
+ ret: // the Ret frame popped into top, the value in acon_val
+  {
+    for (uint32_t i = 0; i < top.b; ++i, ++stack) {
+      vars[stack->a] = stack->immediate;
+    }
+    if (top.c) {
+      memo_store(top.a, stack, top.b, acon_val);
+      stack += top.b;
+    }
+    goto acon;
+  }
  assign:
 #ifdef DEBUG
 dump_seg("assign:",&top, &top+1, "\n");
@@ -501,6 +1014,25 @@ printf("\n");
 }
 
 int perm(struct node n) {
+  if (permanent_next == permanent_top) {
+    // everything refers to permanent by index, so it can move
+    long size = permanent_top - permanent;
+    permanent = realloc(permanent, 2*size*sizeof(struct node));
+#ifdef HYBRID
+    safe = realloc(safe, 2*size);
+    if (!safe) {
+      exit(1);
+    }
+#endif
+    if (!permanent) {
+      exit(1);
+    }
+    permanent_next = permanent + size;
+    permanent_top = permanent + 2*size;
+  }
+#ifdef HYBRID
+  safe[permanent_next - permanent] = is_safe(n, permanent_next - permanent);
+#endif
   *permanent_next = n;
   return permanent_next++ - permanent;
 }
@@ -535,6 +1067,38 @@ int pAdd(int a, int b) {
 int pLe(int a, int b) {
   return perm(mkBinary(Le,a,b));
 }
+int pBool(int val) {
+  return perm(mkImm(BCon,val));
+}
+int pSkip() {
+  return perm(mkNullary(Skip));
+}
+int pIf(int cond, int t, int e) {
+  return perm(mkTernary(If,cond,t,e));
+}
+int pDiv(int a, int b) {
+  return perm(mkBinary(Div,a,b));
+}
+int pAnd(int a, int b) {
+  return perm(mkBinary(And,a,b));
+}
+int pRead() {
+  return perm(mkNullary(Read));
+}
+int pPrint(int exp) {
+  return perm(mkUnary(Print,exp));
+}
+// A recursive procedure calls itself before its body exists: build it
+// with body 0 and set permanent[proc].b afterwards.
+int pProc(int params, int body) {
+  return perm(mkTernary(Proc,params,body,0));
+}
+int pCall(int proc, int args) {
+  return perm(mkBinary(Call,proc,args));
+}
+int pReturn(int exp) {
+  return perm(mkUnary(Return,exp));
+}
 
 struct node load_sum(long n) {
   int vars = pCons(pVar(0),pCons(pVar(1),pNil()));
@@ -547,6 +1111,159 @@ struct node load_sum(long n) {
   return (struct node){Pgm,vars,body,0};
 }
 
+// Copies every node reachable from pgm into a fresh arena in the order
+// run_k visits them: each node is followed by its operands, so a loop
+// body and the expressions inside it sit in one contiguous run.
+// Returns pgm with its indices rewritten. Nodes shared between parents
+// are copied once.
+struct node relayout(struct node pgm) {
+  long size = permanent_top - permanent;
+  long count = permanent_next - permanent;
+  struct node* old = permanent;
+  uint32_t* moved = malloc(count*sizeof(uint32_t));
+  uint32_t* todo = malloc(count*sizeof(uint32_t));
+  for (long i = 0; i < count; ++i) {
+    moved[i] = UINT32_MAX;
+  }
+  permanent = aligned_alloc(0x10,size*sizeof(struct node));
+  permanent_top = permanent + size;
+  permanent_next = permanent;
+#ifdef HYBRID
+  uint8_t* old_safe = safe;
+  safe = malloc(size);
+#endif
+  uint32_t roots[2] = {pgm.a, pgm.b};
+  for (int r = 0; r < 2; ++r) {
+    // depth-first, pushing children last-to-first so that a comes first
+    long sp = 0;
+    todo[sp++] = roots[r];
+    while (sp > 0) {
+      uint32_t ix = todo[--sp];
+      if (moved[ix] != UINT32_MAX) {
+        continue;
+      }
+      struct node n = old[ix];
+      moved[ix] = permanent_next - permanent;
+#ifdef HYBRID
+      safe[moved[ix]] = old_safe[ix];
+#endif
+      *permanent_next++ = n;
+      switch (n.op >> 4) {
+      case 3:
+        todo[sp++] = n.c;
+      case 2:
+        todo[sp++] = n.b;
+      case 1:
+        todo[sp++] = n.a;
+      }
+    }
+  }
+  for (struct node* p = permanent; p < permanent_next; ++p) {
+    switch (p->op >> 4) {
+    case 3:
+      p->c = moved[p->c];
+    case 2:
+      p->b = moved[p->b];
+    case 1:
+      p->a = moved[p->a];
+    }
+  }
+  pgm.a = moved[pgm.a];
+  pgm.b = moved[pgm.b];
+  free(old);
+  free(moved);
+  free(todo);
+#ifdef HYBRID
+  free(old_safe);
+#endif
+  return pgm;
+}
+
+// A loop of k assignments sum = sum + (n + i) whose nodes are
+// allocated level by level (all leaves first, then all inner Adds, and
+// so on), each level in shuffled order, as a generator working from a
+// worklist might. Running one statement then touches nodes spread all
+// over the arena.
+struct node load_scattered(long n, long k) {
+  int vars = pCons(pVar(0),pCons(pVar(1),pNil()));
+  int* ix = malloc(4*k*sizeof(int));
+  long* order = malloc(k*sizeof(long));
+  uint64_t seed = 88172645463325252ull;
+  for (long i = 0; i < k; ++i) {
+    order[i] = i;
+  }
+  for (int level = 0; level < 6; ++level) {
+    for (long i = k-1; i > 0; --i) {
+      seed ^= seed << 13;
+      seed ^= seed >> 7;
+      seed ^= seed << 17;
+      long j = seed % (i+1);
+      long t = order[i];
+      order[i] = order[j];
+      order[j] = t;
+    }
+    for (long o = 0; o < k; ++o) {
+      long i = order[o];
+      switch (level) {
+      case 0: ix[4*i] = pVar(1); break;
+      case 1: ix[4*i+1] = pVar(0); break;
+      case 2: ix[4*i+2] = pCon(i % 1000); break;
+      case 3: ix[4*i+3] = pAdd(ix[4*i+1],ix[4*i+2]); break;
+      case 4: ix[4*i] = pAdd(ix[4*i],ix[4*i+3]); break;
+      case 5: ix[4*i] = pAssign(ix[4*i],1); break;
+      }
+    }
+  }
+  int body = pAssign(pAdd(pVar(0),pCon((uint64_t)-1)),0);
+  for (long i = k-1; i >= 0; --i) {
+    body = pSeq(ix[4*i],body);
+  }
+  free(ix);
+  free(order);
+  int pgm =
+    pSeq(pAssign(pCon(n),0),
+    pSeq(pAssign(pCon(0),1),
+         pWhile(pNot(pLe(pVar(0),pCon(0))), body)));
+  return (struct node){Pgm,vars,pgm,0};
+}
+
+// A streaming filter: reads a count and then that many numbers, and
+// prints the running sum after each one.
+//   int n, sum;
+//   n = read();
+//   while (!(n <= 0)) { sum = sum + read(); print(sum); n = n + -1; }
+struct node load_filter() {
+  int vars = pCons(pVar(0),pCons(pVar(1),pNil()));
+  int body =
+    pSeq(pAssign(pRead(),0),
+         pWhile(pNot(pLe(pVar(0),pCon(0))),
+                pSeq(pAssign(pAdd(pVar(1),pRead()),1),
+                pSeq(pPrint(pVar(1)),
+                     pAssign(pAdd(pVar(0),pCon((uint64_t)-1)),0)))));
+  return (struct node){Pgm,vars,body,0};
+}
+
+// Fibonacci by naive recursion, exponential without the memo table
+// and linear with it:
+//   int n, sum, k;
+//   proc fib(k) {
+//     if (k <= 1) { return k; } else { return fib(k + -1) + fib(k + -2); }
+//   }
+//   sum = fib(n);
+struct node load_fib(long n) {
+  int vars = pCons(pVar(0),pCons(pVar(1),pCons(pVar(2),pNil())));
+  int fib = pProc(pCons(pVar(2),pNil()),0);
+  permanent[fib].b =
+    pIf(pLe(pVar(2),pCon(1)),
+        pReturn(pVar(2)),
+        pReturn(pAdd(pCall(fib,pCons(pAdd(pVar(2),pCon((uint64_t)-1)),pNil())),
+                      pCall(fib,pCons(pAdd(pVar(2),pCon((uint64_t)-2)),pNil())))));
+  int body =
+    pSeq(pAssign(pCon(n),0),
+         pAssign(pCall(fib,pCons(pVar(0),pNil())),1));
+  return (struct node){Pgm,vars,body,0};
+}
+
 struct node load_test(long n) {
   int vars = pCons(pVar(0),pCons(pVar(1),pNil()));
   int body =
@@ -555,14 +1272,170 @@ struct node load_test(long n) {
   return (struct node){Pgm,vars,body,0};
 }
 
+// Usage: imp [-s] [-r] [-O] N [K]
+//        imp [-s] [-r] [-O] -f
+//        imp [-s] [-r] [-O] -i FILE
+//        imp [-s] [-r] [-O] [-m M] -F N
+// (each also takes -C FILE)
+//   -f  run load_filter over stdin
+//   -F  run load_fib(N), which computes fib(N) by naive recursion
+//   -i  run the program image in FILE (see imp-gen.c) and print every
+//       variable instead of n and sum
+//   -c  print the final configuration in K syntax instead of the Done
+//       line, also when stuck. print() output still in the buffer
+//       shows up only in the <out> cell, not on stdout, so stdout
+//       differs from a plain run's (output past the 1MB buffer has
+//       already been written)
+//   -s  report the continuation stack high-water mark and the run
+//       time on stderr
+//   -r  relayout the program into execution order before running
+//   -O  run the loop optimizer (loop-opt.c) before running
+//   -m  memoize calls to pure procedures in a table of M entries,
+//       least recently used first out (proc-c.c)
+//   -C  look the run up in the result cache FILE, shared between
+//       runs and processes, and record it there if it is not
+//       (cache-c.c); ignored with -c, and for programs that print
+//   -p  (built with -DPROFILE and prof-c.c) sample the run, print
+//       time per statement and per node on stderr and write folded
+//       stacks for flamegraph.pl to FILE
+//   K   run load_scattered(N, K) instead of the sum of 1..N; compare
+//       with and without -r, e.g. under perf stat -e cache-misses
 int main(int argc, char** argv) {
+  int stats = 0, reorder = 0, optimize = 0, filter = 0, fib = 0;
+  long memo = 0;
+  const char* image = NULL;
+  const char* cache = NULL;
+  int arg = 1;
+  for (; arg < argc; ++arg) {
+    if (!strcmp(argv[arg], "-s")) {
+      stats = 1;
+    } else if (!strcmp(argv[arg], "-r")) {
+      reorder = 1;
+    } else if (!strcmp(argv[arg], "-O")) {
+      optimize = 1;
+    } else if (!strcmp(argv[arg], "-f")) {
+      filter = 1;
+    } else if (!strcmp(argv[arg], "-F")) {
+      fib = 1;
+    } else if (!strcmp(argv[arg], "-m") && arg + 1 < argc) {
+      memo = atol(argv[++arg]);
+    } else if (!strcmp(argv[arg], "-c")) {
+      dump_on_exit = 1;
+    } else if (!strcmp(argv[arg], "-i") && arg + 1 < argc) {
+      image = argv[++arg];
+    } else if (!strcmp(argv[arg], "-C") && arg + 1 < argc) {
+      cache = argv[++arg];
+#ifdef PROFILE
+    } else if (!strcmp(argv[arg], "-p") && arg + 1 < argc) {
+      prof_folded = argv[++arg];
+#endif
+    } else {
+      break;
+    }
+  }
   initGC();
-  struct node pgm = load_sum(atoi(argv[1]));
+  io_init();
+  struct node pgm;
+  int64_t nvars = 2;
+  if (image) {
+    if (read_image(image, &pgm, &nvars)) {
+      fprintf(stderr, "imp: cannot read image %s\n", image);
+      return 1;
+    }
+    from_image = 1;
+    // n/sum/k are the built-in loaders' names; image variables are x<id>
+    var_name_count = 0;
+  } else {
+    pgm = filter ? load_filter()
+      : fib ? load_fib(atol(argv[arg]))
+      : arg + 1 < argc
+      ? load_scattered(atol(argv[arg]), atol(argv[arg+1]))
+      : load_sum(atoi(argv[arg]));
+  }
+  if (fib) {
+    nvars = 3;
+  }
+  vars = calloc(nvars, sizeof(int64_t));
+  if (!vars) {
+    exit(1);
+  }
+#ifdef PROFILE
+  // a cached run has nothing to sample
+  cache = NULL;
+#endif
+  if (cache && !dump_on_exit && cache_open(cache) != 0) {
+    fprintf(stderr, "imp: cannot use cache %s\n", cache);
+  } else if (cache && !dump_on_exit) {
+    // before prepare_procs rewrites Procs, so -m shares entries
+    cache_pending = cache_key(pgm, vars, nvars);
+  }
+  if (prepare_procs(pgm, memo > 0) < 0) {
+    fprintf(stderr, "imp: ill-formed procedure call or return\n");
+    return 1;
+  }
+  int cache_hit = 0, cache_status = 0;
+  if (cache_pending) {
+    cache_hit = cache_lookup(vars, &cache_status);
+    cache_pending = !cache_hit;
+  }
+  if (cache_hit && cache_status == 2) {
+    if (from_image) {
+      print_image_state("Stuck.", pgm.a, vars);
+    }
+    return 2;
+  }
+  if (memo > 0) {
+    memo_init(memo);
+  }
+  if (reorder) {
+    pgm = relayout(pgm);
+  }
+  if (optimize) {
+    optimize_loops(pgm.b);
+  }
 #ifdef DEBUG
   dump_seg("[%2d] = ",permanent, permanent_next, "\n");
 #endif
-  run_k(pgm);
-  printf("Done. n=%"PRIi64" sum=%"PRIi64"\n",vars[0],vars[1]);
+  pgm_vars = pgm.a;
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+#ifdef PROFILE
+  prof_start();
+#endif
+  if (!cache_hit) {
+    run_k(pgm);
+  }
+#ifdef PROFILE
+  prof_stop();
+#endif
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (cache_pending) {
+    cache_store(vars, 0);
+  }
+  if (dump_on_exit) {
+    // unwritten output goes in the <out> cell
+    dump_config(NULL, stack, stack_top, pgm_vars, vars, var_names, var_name_count, 0);
+  } else if (from_image) {
+    io_flush();
+    print_image_state("Done.", pgm_vars, vars);
+  } else {
+    io_flush();
+    printf("Done. n=%"PRIi64" sum=%"PRIi64"\n",vars[0],vars[1]);
+  }
+  if (stats) {
+    fprintf(stderr, "stack high-water mark: %ld frames\n", stack_high_water());
+    fprintf(stderr, "run_k: %.3fs\n", (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    if (cache && !dump_on_exit) {
+      fprintf(stderr, "cache: %s\n", cache_hit ? "hit" : cache_pending ? "stored" : "not cacheable");
+    }
+    if (memo > 0) {
+      fprintf(stderr, "memo: %" PRIi64 " hits, %" PRIi64 " misses, %" PRIi64 " evictions\n",
+              memo_hits, memo_misses, memo_evictions);
+    }
+  }
+#ifdef PROFILE
+  prof_report(stderr, prof_folded);
+#endif
   return 0;
 }
 
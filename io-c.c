@@ -0,0 +1,202 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Streams behind IMP's read() and print(). Input is mapped, from the
+// current offset to the end, when stdin is a regular file and read in
+// 1MB blocks otherwise; output collects in a 1MB buffer that goes out
+// in one write when it fills and at exit. Integers are parsed and
+// formatted by hand, so neither side touches stdio.
+
+#define IO_BLOCK 0x100000
+
+static const char* in_cur;
+static const char* in_end;
+static char* in_buf;
+static int in_mapped;
+static int in_eof;
+// stdin is a regular file, all of it mapped (or empty)
+static int in_whole;
+
+static char out_buf[IO_BLOCK];
+static size_t out_len;
+
+static void write_all(const char* p, size_t n) {
+  while (n > 0) {
+    ssize_t w = write(1, p, n);
+    if (w <= 0) {
+      _exit(1);
+    }
+    p += w;
+    n -= w;
+  }
+}
+
+void io_flush() {
+  write_all(out_buf, out_len);
+  out_len = 0;
+}
+
+void io_init() {
+  struct stat st;
+  // from where stdin is, which need not be the start of the file
+  off_t pos = lseek(0, 0, SEEK_CUR);
+  if (fstat(0, &st) == 0 && S_ISREG(st.st_mode) && pos >= 0) {
+    if (st.st_size <= pos) {
+      in_whole = 1;
+      in_eof = 1;
+    } else {
+      // mmap offsets must be page aligned
+      off_t skip = pos % sysconf(_SC_PAGESIZE);
+      size_t len = st.st_size - pos + skip;
+      void* p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, 0, pos - skip);
+      if (p != MAP_FAILED) {
+        madvise(p, len, MADV_SEQUENTIAL);
+        in_cur = (const char*)p + skip;
+        in_end = (const char*)p + len;
+        in_mapped = 1;
+        in_whole = 1;
+        in_eof = 1;
+      }
+    }
+  }
+  if (!in_mapped) {
+    in_buf = malloc(IO_BLOCK);
+    in_cur = in_end = in_buf;
+  }
+  atexit(io_flush);
+}
+
+// 1, with all of the input still to come in *p and *n, when stdin is a
+// regular file and nothing has been read from it yet; 0 for a stream,
+// which would have to be consumed to see it all.
+int io_input(const char** p, size_t* n) {
+  if (!in_whole) {
+    return 0;
+  }
+  *p = in_cur;
+  *n = in_end - in_cur;
+  return 1;
+}
+
+// The input fetched but not yet consumed by read(): all that is left
+// of a regular file, but only the current block of a stream.
+void io_buffered_input(const char** p, size_t* n) {
+  *p = in_cur;
+  *n = in_end - in_cur;
+}
+
+// Refills the input buffer, keeping the len bytes at keep (an integer
+// cut off by the end of the block). Returns 0 once input is exhausted.
+static int refill(const char* keep, size_t len) {
+  if (in_eof) {
+    return 0;
+  }
+  for (size_t i = 0; i < len; ++i) {
+    in_buf[i] = keep[i];
+  }
+  ssize_t r = read(0, in_buf + len, IO_BLOCK - len);
+  if (r <= 0) {
+    in_eof = 1;
+    r = 0;
+  }
+  in_cur = in_buf;
+  in_end = in_buf + len + r;
+  return r > 0;
+}
+
+static int is_space(char c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+// Reads the next integer into *out. Returns 0 at end of input (or on
+// anything that is not an integer), where read() gets stuck.
+int io_read_int(int64_t* out) {
+  for (;;) {
+    while (in_cur < in_end && is_space(*in_cur)) {
+      ++in_cur;
+    }
+    if (in_cur < in_end) {
+      break;
+    }
+    if (!refill(in_cur, 0)) {
+      return 0;
+    }
+  }
+  // make sure the whole token is in the buffer
+  const char* p = in_cur;
+  while (p < in_end && !is_space(*p)) {
+    ++p;
+  }
+  // a pipe can deliver it a few bytes at a time; a token that fills
+  // the whole block is not an integer anyway
+  while (p == in_end && !in_eof && in_end - in_cur < IO_BLOCK) {
+    size_t seen = p - in_cur;
+    refill(in_cur, in_end - in_cur);
+    p = in_cur + seen;
+    while (p < in_end && !is_space(*p)) {
+      ++p;
+    }
+  }
+  const char* s = in_cur;
+  int neg = 0;
+  if (s < p && *s == '-') {
+    neg = 1;
+    ++s;
+  }
+  if (s == p) {
+    return 0;
+  }
+  // 2^63 is in range only as -2^63; anything past the limit is not an
+  // int and leaves read() stuck, as a non-number does
+  uint64_t limit = (uint64_t)INT64_MAX + neg;
+  uint64_t v = 0;
+  for (; s < p; ++s) {
+    if (*s < '0' || *s > '9') {
+      return 0;
+    }
+    uint64_t d = *s - '0';
+    if (v > (limit - d) / 10) {
+      return 0;
+    }
+    v = v*10 + d;
+  }
+  in_cur = p;
+  *out = neg ? (int64_t)(0 - v) : (int64_t)v;
+  return 1;
+}
+
+// Hands over what print() has buffered but not yet written, as lines
+// of one integer each, and drops it from the buffer: the caller shows
+// it instead (imp -c puts it in the <out> cell).
+size_t io_take_output(const char** p) {
+  size_t n = out_len;
+  *p = out_buf;
+  out_len = 0;
+  return n;
+}
+
+// Writes x and a newline.
+void io_print_int(int64_t x) {
+  if (out_len > IO_BLOCK - 24) {
+    io_flush();
+  }
+  char tmp[24];
+  char* t = tmp + sizeof(tmp);
+  uint64_t v = x < 0 ? -(uint64_t)x : (uint64_t)x;
+  *--t = '\n';
+  do {
+    *--t = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  if (x < 0) {
+    *--t = '-';
+  }
+  size_t n = tmp + sizeof(tmp) - t;
+  for (size_t i = 0; i < n; ++i) {
+    out_buf[out_len + i] = t[i];
+  }
+  out_len += n;
+}
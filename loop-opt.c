@@ -0,0 +1,360 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Loop optimizer over the permanent program, shared by imp.c and
+// imp-big-step.c. It rewrites loops in place into nodes the
+// interpreters execute with fewer dispatches:
+//   x = x + k;            =>  Inc x k
+//   x <= k,  !(x <= k)    =>  LeVC x k,  GtVC x k
+//   x <= y,  !(x <= y)    =>  LeVV x y,  GtVV x y
+// and wraps each maximal loop-invariant arithmetic subexpression in an
+// Inv node, which the interpreters evaluate the first time it is reached
+// after entering the loop and reuse until the loop is entered again.
+// Because that first evaluation happens exactly where the original one
+// did, a division by zero still gets stuck at the same point, and the
+// arithmetic itself is unchanged, so it wraps the same way.
+//
+// Procedure bodies are left alone, and a call in a loop counts as
+// assigning every variable, since the procedure may (see proc-c.c).
+
+// 16 bytes. Good.
+struct node {
+  uint32_t op;
+  uint32_t a;
+  union {
+    struct {
+      uint32_t b;
+      uint32_t c;
+    };
+    int64_t immediate;
+  };
+};
+
+extern struct node mkUnaryImm(uint32_t opcode, uint32_t a, uint64_t imm);
+
+#define Op1(Ix) 16  +Ix
+#define Op2(Ix) 16*2+Ix
+#define Op3(Ix) 16*3+Ix
+
+enum OpCode {
+  ACon = 0,
+  AVar = 1,
+  BCon = 2,
+  Skip = 8,
+  Nil = 9,
+  Inc = 10,
+  LeVC = 11,
+  GtVC = 12,
+  LeVV = 13,
+  GtVV = 14,
+
+  Not = Op1(0),
+  Assign = Op1(1),
+  Inv = Op1(8),
+  Print = Op1(10),
+
+  Div = Op2(0),
+  Add = Op2(1),
+  Le = Op2(2),
+  And = Op2(3),
+  While = Op2(4),
+  Seq = Op2(5),
+  WhileI = Op2(9),
+  Call = Op2(11),
+
+  If = Op3(0),
+};
+
+extern struct node* permanent;
+extern struct node* permanent_next;
+extern int perm(struct node n);
+
+// Entering a WhileI stamps loop_epoch[loop id] with a fresh epoch; an
+// Inv slot holds a value computed in the epoch stored next to it.
+struct inv_slot {
+  int64_t epoch;
+  int64_t value;
+};
+
+int64_t epoch;
+int64_t* loop_epoch;
+struct inv_slot* inv_slots;
+
+static uint32_t loops;
+static uint32_t invs;
+static uint64_t nvars;
+
+// 1 when the expression calls a procedure.
+static int calls(uint32_t ix) {
+  struct node n = permanent[ix];
+  if (n.op == Call) {
+    return 1;
+  }
+  switch (n.op >> 4) {
+  case 3:
+    if (calls(n.c)) {
+      return 1;
+    }
+  case 2:
+    if (calls(n.b)) {
+      return 1;
+    }
+  case 1:
+    return calls(n.a);
+  }
+  return 0;
+}
+
+// Marks in set every variable a statement can assign.
+static void assigned_vars(uint32_t ix, uint8_t* set) {
+  struct node n = permanent[ix];
+  if (n.op != Seq && n.op >> 4 && calls(n.a)) {
+    // the condition, or the expression assigned or printed
+    memset(set, 1, nvars);
+  }
+  switch (n.op) {
+  case Assign:
+    set[n.immediate] = 1;
+    break;
+  case Inc:
+    set[n.a] = 1;
+    break;
+  case Seq:
+    assigned_vars(n.a, set);
+    assigned_vars(n.b, set);
+    break;
+  case If:
+    assigned_vars(n.b, set);
+    assigned_vars(n.c, set);
+    break;
+  case While:
+  case WhileI:
+    assigned_vars(n.b, set);
+    break;
+  }
+}
+
+static void max_var(uint32_t ix) {
+  struct node n = permanent[ix];
+  uint64_t v = 0;
+  switch (n.op) {
+  case AVar:
+  case Assign:
+    v = n.immediate;
+    break;
+  case LeVV:
+  case GtVV:
+    v = n.a > n.b ? n.a : n.b;
+    break;
+  case Inc:
+  case LeVC:
+  case GtVC:
+    v = n.a;
+    break;
+  }
+  if (v >= nvars) {
+    nvars = v + 1;
+  }
+  if (n.op == Call) {
+    // the arguments; a is the procedure
+    max_var(n.b);
+    return;
+  }
+  switch (n.op >> 4) {
+  case 3:
+    max_var(n.c);
+  case 2:
+    max_var(n.b);
+  case 1:
+    max_var(n.a);
+  }
+}
+
+// 1 when the arithmetic expression reads nothing the loop assigns.
+static int invariant(uint32_t ix, uint8_t* set) {
+  struct node n = permanent[ix];
+  switch (n.op) {
+  case ACon:
+  case Inv:
+    return 1;
+  case AVar:
+    return !set[n.immediate];
+  case Add:
+  case Div:
+    return invariant(n.a, set) && invariant(n.b, set);
+  default:
+    return 0;
+  }
+}
+
+// Returns the index to use in place of arithmetic expression ix.
+static uint32_t hoist_aexp(uint32_t ix, uint8_t* set, uint32_t loop) {
+  struct node n = permanent[ix];
+  if (n.op != Add && n.op != Div) {
+    return ix;
+  }
+  if (invariant(ix, set)) {
+    return perm(mkUnaryImm(Inv, ix, (uint64_t)loop << 32 | invs++));
+  }
+  uint32_t a = hoist_aexp(n.a, set, loop);
+  uint32_t b = hoist_aexp(n.b, set, loop);
+  permanent[ix].a = a;
+  permanent[ix].b = b;
+  return ix;
+}
+
+static void hoist_bexp(uint32_t ix, uint8_t* set, uint32_t loop) {
+  struct node n = permanent[ix];
+  switch (n.op) {
+  case Not:
+    hoist_bexp(n.a, set, loop);
+    break;
+  case And:
+    hoist_bexp(n.a, set, loop);
+    hoist_bexp(n.b, set, loop);
+    break;
+  case Le:
+  {
+    uint32_t a = hoist_aexp(n.a, set, loop);
+    uint32_t b = hoist_aexp(n.b, set, loop);
+    permanent[ix].a = a;
+    permanent[ix].b = b;
+    break;
+  }
+  }
+}
+
+// Hoists with respect to one loop everywhere inside it, nested loops
+// included: anything invariant in the outer loop is invariant in the
+// inner ones too.
+static void hoist_stmt(uint32_t ix, uint8_t* set, uint32_t loop) {
+  struct node n = permanent[ix];
+  switch (n.op) {
+  case Assign:
+  {
+    uint32_t a = hoist_aexp(n.a, set, loop);
+    permanent[ix].a = a;
+    break;
+  }
+  case Print:
+  {
+    uint32_t a = hoist_aexp(n.a, set, loop);
+    permanent[ix].a = a;
+    break;
+  }
+  case Seq:
+    hoist_stmt(n.a, set, loop);
+    hoist_stmt(n.b, set, loop);
+    break;
+  case If:
+    hoist_bexp(n.a, set, loop);
+    hoist_stmt(n.b, set, loop);
+    hoist_stmt(n.c, set, loop);
+    break;
+  case While:
+  case WhileI:
+    hoist_bexp(n.a, set, loop);
+    hoist_stmt(n.b, set, loop);
+    break;
+  }
+}
+
+static void specialize_bexp(uint32_t ix) {
+  struct node n = permanent[ix];
+  switch (n.op) {
+  case Not:
+    specialize_bexp(n.a);
+    n = permanent[n.a];
+    if (n.op == LeVC) {
+      permanent[ix] = mkUnaryImm(GtVC, n.a, n.immediate);
+    } else if (n.op == LeVV) {
+      permanent[ix] = (struct node){GtVV, n.a, {{n.b, 0}}};
+    }
+    break;
+  case And:
+    specialize_bexp(n.a);
+    specialize_bexp(n.b);
+    break;
+  case Le:
+  {
+    struct node l = permanent[n.a];
+    struct node r = permanent[n.b];
+    if (l.op == AVar && r.op == ACon) {
+      permanent[ix] = mkUnaryImm(LeVC, l.immediate, r.immediate);
+    } else if (l.op == AVar && r.op == AVar) {
+      permanent[ix] = (struct node){LeVV, l.immediate, {{r.immediate, 0}}};
+    }
+    break;
+  }
+  }
+}
+
+static void optimize_stmt(uint32_t ix, int in_loop);
+
+static void optimize_loop(uint32_t ix) {
+  uint8_t* set = calloc(nvars, 1);
+  if (calls(permanent[ix].a)) {
+    // the condition runs every iteration too
+    memset(set, 1, nvars);
+  }
+  assigned_vars(permanent[ix].b, set);
+  uint32_t loop = loops++;
+  uint32_t before = invs;
+  hoist_bexp(permanent[ix].a, set, loop);
+  hoist_stmt(permanent[ix].b, set, loop);
+  free(set);
+  if (invs != before) {
+    // only loops with something to cache pay for the epoch bump
+    permanent[ix].op = WhileI;
+    permanent[ix].c = loop;
+  }
+  specialize_bexp(permanent[ix].a);
+  optimize_stmt(permanent[ix].b, 1);
+}
+
+static void optimize_stmt(uint32_t ix, int in_loop) {
+  struct node n = permanent[ix];
+  switch (n.op) {
+  case Assign:
+  {
+    struct node e = permanent[n.a];
+    if (in_loop && e.op == Add) {
+      struct node l = permanent[e.a];
+      struct node r = permanent[e.b];
+      if (l.op == AVar && l.immediate == n.immediate && r.op == ACon) {
+        permanent[ix] = mkUnaryImm(Inc, n.immediate, r.immediate);
+      } else if (r.op == AVar && r.immediate == n.immediate && l.op == ACon) {
+        permanent[ix] = mkUnaryImm(Inc, n.immediate, l.immediate);
+      }
+    }
+    break;
+  }
+  case Seq:
+    optimize_stmt(n.a, in_loop);
+    optimize_stmt(n.b, in_loop);
+    break;
+  case If:
+    if (in_loop) {
+      specialize_bexp(n.a);
+    }
+    optimize_stmt(n.b, in_loop);
+    optimize_stmt(n.c, in_loop);
+    break;
+  case While:
+    optimize_loop(ix);
+    break;
+  }
+}
+
+// Optimizes every loop in the program body and sets up the caches the
+// interpreters read. Call once, before run_k.
+void optimize_loops(uint32_t body) {
+  nvars = 0;
+  max_var(body);
+  loops = 0;
+  invs = 0;
+  optimize_stmt(body, 0);
+  loop_epoch = calloc(loops + 1, sizeof(int64_t));
+  inv_slots = calloc(invs + 1, sizeof(struct inv_slot));
+}
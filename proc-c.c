@@ -0,0 +1,436 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Procedures for imp.c: the checks the loader runs over a program
+// before it may run, and the memo table for pure procedures.
+//
+// A Proc node holds its parameter list (a Cons list of AVars, which
+// are ordinary declared variables) and its body; a Call holds the Proc
+// it calls and its argument list. A Call's a is a reference, not a
+// child: procedures can be recursive, so following it as a tree edge
+// would not terminate. prepare_procs checks every call against its
+// procedure, stores the parameter count in the Proc's c for run_k,
+// and, when memoizing, rewrites the procedures it can prove pure into
+// ProcM, whose calls run_k looks up in the memo table first. Pure
+// means the result depends on nothing but the arguments and the call
+// has no effect other than returning it: the body reads and assigns
+// only the procedure's own parameters (which the call restores on
+// return), does no I/O, and calls only pure procedures.
+
+// 16 bytes. Good.
+struct node {
+  uint32_t op;
+  uint32_t a;
+  union {
+    struct {
+      uint32_t b;
+      uint32_t c;
+    };
+    int64_t immediate;
+  };
+};
+
+#define Op1(Ix) 16  +Ix
+#define Op2(Ix) 16*2+Ix
+#define Op3(Ix) 16*3+Ix
+
+enum OpCode {
+  ACon = 0,
+  AVar = 1,
+  BCon = 2,
+  Skip = 8,
+  Nil = 9,
+  Inc = 10,
+  LeVC = 11,
+  GtVC = 12,
+  LeVV = 13,
+  GtVV = 14,
+
+  Not = Op1(0),
+  Assign = Op1(1),
+  Inv = Op1(8),
+  Return = Op1(12),
+
+  Div = Op2(0),
+  Add = Op2(1),
+  Le = Op2(2),
+  And = Op2(3),
+  While = Op2(4),
+  Seq = Op2(5),
+  Cons = Op2(6),
+  WhileI = Op2(9),
+  Proc = Op2(10),
+  Call = Op2(11),
+  ProcM = Op2(14),
+
+  If = Op3(0),
+};
+
+extern struct node* permanent;
+extern struct node* permanent_next;
+
+// Procedures with more parameters than this are never memoized.
+#define MEMO_MAX_ARGS 4
+
+static uint32_t count;
+// walk stamps, so one node array serves every walk
+static uint32_t* seen;
+static uint32_t stamp;
+static uint32_t* todo;
+
+static uint32_t list_length(uint32_t ix) {
+  uint32_t n = 0;
+  for (; permanent[ix].op == Cons && n <= count; ix = permanent[ix].b) {
+    ++n;
+  }
+  return n;
+}
+
+static int is_param(uint32_t proc, int64_t var) {
+  for (uint32_t v = permanent[proc].a; permanent[v].op == Cons; v = permanent[v].b) {
+    if (permanent[permanent[v].a].immediate == var) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Procedures found so far, in the order found, with what their walk
+// learned about them.
+static uint32_t* procs;
+static uint32_t nprocs;
+// where in procs each node is, if it is a procedure found so far
+static uint32_t* proc_slot;
+static uint8_t* impure;
+// callees[i] lists, per procedure, the procedures its body calls
+static uint32_t** callees;
+static uint32_t* ncallees;
+
+// Index in procs of the Proc node p, adding it if new; -1 when p is
+// not a procedure or its parameter list is not a list of variables.
+static int64_t find_proc(uint32_t p) {
+  if (p >= count || (permanent[p].op != Proc && permanent[p].op != ProcM)) {
+    return -1;
+  }
+  if (proc_slot[p] != UINT32_MAX) {
+    return proc_slot[p];
+  }
+  uint32_t v = permanent[p].a;
+  for (; permanent[v].op == Cons; v = permanent[v].b) {
+    if (permanent[permanent[v].a].op != AVar) {
+      return -1;
+    }
+  }
+  if (permanent[v].op != Nil) {
+    return -1;
+  }
+  permanent[p].op = Proc;
+  permanent[p].c = list_length(permanent[p].a);
+  procs[nprocs] = p;
+  proc_slot[p] = nprocs;
+  callees[nprocs] = NULL;
+  ncallees[nprocs] = 0;
+  impure[nprocs] = 0;
+  return nprocs++;
+}
+
+// Walks the statement root, which is the body of procs[self], or the
+// main program when self is -1. Returns 0 if the walk found an ill-
+// formed call, or a return outside any procedure.
+static int walk(uint32_t root, int64_t self) {
+  uint32_t proc = self < 0 ? 0 : procs[self];
+  ++stamp;
+  long sp = 0;
+  todo[sp++] = root;
+  while (sp > 0) {
+    uint32_t ix = todo[--sp];
+    if (seen[ix] == stamp) {
+      continue;
+    }
+    seen[ix] = stamp;
+    struct node n = permanent[ix];
+    int local = 1;
+    switch (n.op) {
+    case ACon:
+    case BCon:
+    case Skip:
+    case Nil:
+    case Not:
+    case Inv:
+    case Div:
+    case Add:
+    case Le:
+    case And:
+    case While:
+    case WhileI:
+    case Seq:
+    case Cons:
+    case If:
+      break;
+    case AVar:
+    case Assign:
+      local = self >= 0 && is_param(proc, n.immediate);
+      break;
+    case Inc:
+    case LeVC:
+    case GtVC:
+      local = self >= 0 && is_param(proc, n.a);
+      break;
+    case LeVV:
+    case GtVV:
+      local = self >= 0 && is_param(proc, n.a) && is_param(proc, n.b);
+      break;
+    case Return:
+      if (self < 0) {
+        return 0;
+      }
+      break;
+    case Call:
+    {
+      int64_t callee = find_proc(n.a);
+      if (callee < 0 || list_length(n.b) != permanent[n.a].c) {
+        return 0;
+      }
+      if (self >= 0) {
+        uint32_t k = ncallees[self]++;
+        callees[self] = realloc(callees[self], (k + 1) * sizeof(uint32_t));
+        if (!callees[self]) {
+          exit(1);
+        }
+        callees[self][k] = callee;
+      }
+      // the arguments only: a is the procedure, not a subtree
+      todo[sp++] = n.b;
+      continue;
+    }
+    default:
+      // I/O and anything else: fine to run, but not pure
+      local = 0;
+    }
+    if (!local && self >= 0) {
+      impure[self] = 1;
+    }
+    switch (n.op >> 4) {
+    case 3:
+      todo[sp++] = n.c;
+    case 2:
+      todo[sp++] = n.b;
+    case 1:
+      todo[sp++] = n.a;
+    }
+  }
+  return 1;
+}
+
+// Checks pgm's calls and returns and sets up every procedure it calls
+// for run_k: the parameter count in c, and, when memo is set, op ProcM
+// for the pure ones with at most MEMO_MAX_ARGS parameters. Returns the
+// number of procedures, or -1 if a call names something that is not a
+// procedure or passes the wrong number of arguments, or a return is
+// not inside a procedure.
+int64_t prepare_procs(struct node pgm, int memo) {
+  count = permanent_next - permanent;
+  seen = calloc(count, sizeof(uint32_t));
+  todo = malloc(3 * (size_t)count * sizeof(uint32_t) + 1);
+  procs = malloc(count * sizeof(uint32_t));
+  proc_slot = malloc(count * sizeof(uint32_t));
+  impure = malloc(count);
+  callees = malloc(count * sizeof(uint32_t*));
+  ncallees = malloc(count * sizeof(uint32_t));
+  if (!seen || !todo || !procs || !proc_slot || !impure || !callees || !ncallees) {
+    exit(1);
+  }
+  memset(proc_slot, 0xff, count * sizeof(uint32_t));
+  stamp = 0;
+  nprocs = 0;
+  int ok = walk(pgm.b, -1);
+  // walking a body can find more procedures
+  for (uint32_t i = 0; ok && i < nprocs; ++i) {
+    ok = walk(permanent[procs[i]].b, i);
+  }
+  // calling an impure procedure is impure; iterate to a fixed point
+  for (int changed = ok; changed; ) {
+    changed = 0;
+    for (uint32_t i = 0; i < nprocs; ++i) {
+      for (uint32_t k = 0; !impure[i] && k < ncallees[i]; ++k) {
+        if (impure[callees[i][k]]) {
+          impure[i] = 1;
+          changed = 1;
+        }
+      }
+    }
+  }
+  for (uint32_t i = 0; ok && i < nprocs; ++i) {
+    if (memo && !impure[i] && permanent[procs[i]].c <= MEMO_MAX_ARGS) {
+      permanent[procs[i]].op = ProcM;
+    }
+  }
+  for (uint32_t i = 0; i < nprocs; ++i) {
+    free(callees[i]);
+  }
+  int64_t found = ok ? nprocs : -1;
+  free(seen);
+  free(todo);
+  free(procs);
+  free(proc_slot);
+  free(impure);
+  free(callees);
+  free(ncallees);
+  return found;
+}
+
+// The memo table: a fixed number of entries, found through a chained
+// hash on the procedure and its arguments, and kept on a list from
+// most to least recently used. A full table replaces its least
+// recently used entry.
+
+#define NO_ENTRY UINT32_MAX
+
+struct memo_entry {
+  uint32_t proc;
+  uint32_t chain;
+  uint32_t newer;
+  uint32_t older;
+  uint32_t nargs;
+  int64_t args[MEMO_MAX_ARGS];
+  int64_t value;
+};
+
+static struct memo_entry* entries;
+static uint32_t* buckets;
+static uint64_t bucket_mask;
+static uint32_t capacity;
+static uint32_t used;
+static uint32_t newest = NO_ENTRY;
+static uint32_t oldest = NO_ENTRY;
+
+int64_t memo_hits;
+int64_t memo_misses;
+int64_t memo_evictions;
+
+// Sets up a table of n entries. Call before run_k when memoizing.
+void memo_init(uint32_t n) {
+  capacity = n;
+  uint64_t size = 16;
+  while (size < (uint64_t)n) {
+    size *= 2;
+  }
+  bucket_mask = size - 1;
+  entries = malloc(n * sizeof(struct memo_entry));
+  buckets = malloc(size * sizeof(uint32_t));
+  if (!entries || !buckets) {
+    exit(1);
+  }
+  memset(buckets, 0xff, size * sizeof(uint32_t));
+}
+
+// The arguments are run_k's argument frames: n of them, values in
+// immediate, last argument first.
+static uint64_t memo_hash(uint32_t proc, const struct node* args, uint32_t n) {
+  uint64_t h = proc * 0x9e3779b97f4a7c15ull;
+  for (uint32_t i = 0; i < n; ++i) {
+    h = (h ^ (uint64_t)args[i].immediate) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+  }
+  return h & bucket_mask;
+}
+
+static uint32_t memo_find(uint32_t proc, const struct node* args, uint32_t n, uint64_t h) {
+  for (uint32_t e = buckets[h]; e != NO_ENTRY; e = entries[e].chain) {
+    if (entries[e].proc != proc) {
+      continue;
+    }
+    uint32_t i = 0;
+    while (i < n && entries[e].args[i] == args[i].immediate) {
+      ++i;
+    }
+    if (i == n) {
+      return e;
+    }
+  }
+  return NO_ENTRY;
+}
+
+static void unlink_lru(uint32_t e) {
+  struct memo_entry* m = &entries[e];
+  if (m->newer != NO_ENTRY) {
+    entries[m->newer].older = m->older;
+  } else {
+    newest = m->older;
+  }
+  if (m->older != NO_ENTRY) {
+    entries[m->older].newer = m->newer;
+  } else {
+    oldest = m->newer;
+  }
+}
+
+static void push_newest(uint32_t e) {
+  entries[e].newer = NO_ENTRY;
+  entries[e].older = newest;
+  if (newest != NO_ENTRY) {
+    entries[newest].newer = e;
+  } else {
+    oldest = e;
+  }
+  newest = e;
+}
+
+// 1 and the value in *out when proc was called with these arguments
+// before and the result is still in the table.
+int memo_lookup(uint32_t proc, const struct node* args, uint32_t n, int64_t* out) {
+  uint32_t e = memo_find(proc, args, n, memo_hash(proc, args, n));
+  if (e == NO_ENTRY) {
+    ++memo_misses;
+    return 0;
+  }
+  ++memo_hits;
+  if (e != newest) {
+    unlink_lru(e);
+    push_newest(e);
+  }
+  *out = entries[e].value;
+  return 1;
+}
+
+void memo_store(uint32_t proc, const struct node* args, uint32_t n, int64_t value) {
+  if (capacity == 0) {
+    return;
+  }
+  uint64_t h = memo_hash(proc, args, n);
+  uint32_t e = memo_find(proc, args, n, h);
+  if (e != NO_ENTRY) {
+    // a recursive call stored it while this one was running
+    entries[e].value = value;
+    return;
+  }
+  if (used < capacity) {
+    e = used++;
+  } else {
+    e = oldest;
+    unlink_lru(e);
+    struct memo_entry* m = &entries[e];
+    // rehash its key to find the link to it in its chain
+    struct node key[MEMO_MAX_ARGS];
+    for (uint32_t i = 0; i < m->nargs; ++i) {
+      key[i].immediate = m->args[i];
+    }
+    uint32_t* p = &buckets[memo_hash(m->proc, key, m->nargs)];
+    while (*p != e) {
+      p = &entries[*p].chain;
+    }
+    *p = m->chain;
+    ++memo_evictions;
+  }
+  struct memo_entry* m = &entries[e];
+  m->proc = proc;
+  m->nargs = n;
+  for (uint32_t i = 0; i < n; ++i) {
+    m->args[i] = args[i].immediate;
+  }
+  m->value = value;
+  m->chain = buckets[h];
+  buckets[h] = e;
+  push_newest(e);
+}
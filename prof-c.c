@@ -0,0 +1,417 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+// Sampling profiler for imp.c built with -DPROFILE. The SIGPROF
+// handler copies the innermost frames of the continuation stack, which
+// run_k keeps in the global stack anyway, so run_k itself is the same
+// code with and without -DPROFILE. Polling a flag at each dispatch so
+// the sample could include the node about to run cost 7-10% on
+// imp-gen images (and publishing that node for the handler 10-15% on
+// load_sum); now only the ticks cost anything, 1-2% of run time. The
+// price is resolution: a sample is charged to the innermost node a
+// frame says run_k is inside of, the statement for most frames, so
+// leaves never get self time, and a loop body's last statement, which
+// has no Seq frame of its own, is charged to the loop. A tick that
+// lands between run_k moving stack and writing the frame there sees a
+// stale frame; that is rare enough not to matter to a profile.
+// Samples go into a buffer allocated up front; once it is full it
+// keeps a uniform sample of the whole run (reservoir sampling), so
+// long runs are not biased toward their start.
+//
+// Frames hold node values, not indices, so the report maps them back
+// into permanent through their children, or by content for the
+// statements a Seq pushes. A parent map then gives every sample its
+// chain of enclosing nodes up to the program root: the K continuation,
+// as far as the source is concerned.
+
+// 16 bytes. Good.
+struct node {
+  uint32_t op;
+  uint32_t a;
+  union {
+    struct {
+      uint32_t b;
+      uint32_t c;
+    };
+    int64_t immediate;
+  };
+};
+
+#define Op1(Ix) 16  +Ix
+#define Op2(Ix) 16*2+Ix
+#define Op3(Ix) 16*3+Ix
+
+enum OpCode {
+  DivR = 3,
+  AddR = 4,
+  LeR = 5,
+  NotF = 6,
+  AssignR = 7,
+  Skip = 8,
+  Inc = 10,
+
+  Assign = Op1(1),
+  DivL = Op1(2),
+  AddL = Op1(3),
+  LeL = Op1(4),
+  AndL = Op1(5),
+  InvR = Op1(9),
+  Print = Op1(10),
+  PrintR = Op1(11),
+  Return = Op1(12),
+  ReturnR = Op1(13),
+  Ret = Op1(14),
+  Save = Op1(15),
+
+  While = Op2(4),
+  Seq = Op2(5),
+  WhileC = Op2(7),
+  IfC = Op2(8),
+  WhileI = Op2(9),
+  Call = Op2(11),
+  ArgK = Op2(12),
+  ArgV = Op2(13),
+
+  If = Op3(0),
+};
+
+extern struct node* permanent;
+extern struct node* permanent_next;
+extern struct node* stack;
+extern struct node* stack_top;
+extern const char* opnames[64];
+
+#define PROF_FRAMES 8
+#define PROF_SAMPLES (1 << 16)
+#define PROF_USEC 1000
+
+struct prof_sample {
+  uint32_t nframes;
+  struct node frames[PROF_FRAMES];
+};
+
+static struct prof_sample* samples;
+static uint64_t taken;
+static uint64_t rng = 88172645463325252ull;
+
+static void prof_tick(int sig) {
+  uint64_t n = taken++;
+  struct prof_sample* s;
+  if (n < PROF_SAMPLES) {
+    s = &samples[n];
+  } else {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    uint64_t j = rng % (n + 1);
+    if (j >= PROF_SAMPLES) {
+      return;
+    }
+    s = &samples[j];
+  }
+  uint32_t nf = stack_top - stack < PROF_FRAMES ? stack_top - stack : PROF_FRAMES;
+  memcpy(s->frames, stack, nf * sizeof(struct node));
+  s->nframes = nf;
+}
+
+void prof_start() {
+  samples = malloc(PROF_SAMPLES * sizeof(struct prof_sample));
+  if (!samples) {
+    exit(1);
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = prof_tick;
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &sa, NULL);
+  struct itimerval it = {{0, PROF_USEC}, {0, PROF_USEC}};
+  setitimer(ITIMER_PROF, &it, NULL);
+}
+
+void prof_stop() {
+  struct itimerval it;
+  memset(&it, 0, sizeof(it));
+  setitimer(ITIMER_PROF, &it, NULL);
+}
+
+// Report side: everything below runs after run_k.
+
+#define NONE UINT32_MAX
+
+static uint32_t* parent;
+// nearest ancestor that is not a Seq, which is only plumbing
+static uint32_t* up;
+static uint32_t count;
+
+// Open-addressing table from node contents to index; dup marks
+// contents that occur more than once.
+static uint32_t* table;
+static uint8_t* dup;
+static uint64_t table_mask;
+
+static uint64_t hash_node(struct node n) {
+  // a mixed in before immediate, or a Seq's a ^ b would cancel and
+  // every Seq over neighbouring statements land in one cluster
+  uint64_t h = ((uint64_t)n.op << 32 | n.a) * 0x9e3779b97f4a7c15ull;
+  h = (h ^ h >> 32 ^ (uint64_t)n.immediate) * 0xff51afd7ed558ccdull;
+  return h ^ h >> 29;
+}
+
+static int same_node(struct node x, struct node y) {
+  return x.op == y.op && x.a == y.a && x.immediate == y.immediate;
+}
+
+static uint32_t* slot_for(struct node n) {
+  uint64_t h = hash_node(n) & table_mask;
+  while (table[h] != NONE && !same_node(permanent[table[h]], n)) {
+    h = (h + 1) & table_mask;
+  }
+  return &table[h];
+}
+
+static int is_stmt(uint32_t op) {
+  switch (op) {
+  case Skip:
+  case Inc:
+  case Assign:
+  case Print:
+  case Return:
+  case While:
+  case WhileI:
+  case If:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static void build_maps() {
+  count = permanent_next - permanent;
+  parent = malloc(count * sizeof(uint32_t));
+  up = malloc(count * sizeof(uint32_t));
+  uint64_t size = 16;
+  while (size < 2 * (uint64_t)count) {
+    size *= 2;
+  }
+  table_mask = size - 1;
+  table = malloc(size * sizeof(uint32_t));
+  dup = calloc(count, 1);
+  if (!parent || !up || !table || !dup) {
+    exit(1);
+  }
+  memset(parent, 0xff, count * sizeof(uint32_t));
+  memset(up, 0xff, count * sizeof(uint32_t));
+  memset(table, 0xff, size * sizeof(uint32_t));
+  for (uint32_t i = 0; i < count; ++i) {
+    struct node n = permanent[i];
+    switch (n.op == Call ? 0 : n.op >> 4) {
+    case 3:
+      parent[n.c] = i;
+    case 2:
+      parent[n.b] = i;
+    case 1:
+      parent[n.a] = i;
+    }
+    if (n.op == Call) {
+      // a is the procedure, which has no parent: its body's chains
+      // stop at it rather than at one of its callers
+      parent[n.b] = i;
+    }
+    uint32_t* s = slot_for(n);
+    if (*s == NONE) {
+      *s = i;
+    } else {
+      dup[*s] = 1;
+    }
+  }
+  // up[] through chains of Seq, iteratively: they can be millions long
+  uint32_t* path = malloc(count * sizeof(uint32_t));
+  uint8_t* done = calloc(count, 1);
+  if (!path || !done) {
+    exit(1);
+  }
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t len = 0;
+    uint32_t p = parent[i];
+    while (p != NONE && permanent[p].op == Seq && !done[p]) {
+      path[len++] = p;
+      p = parent[p];
+    }
+    uint32_t u = p == NONE ? NONE : permanent[p].op == Seq ? up[p] : p;
+    up[i] = u;
+    done[i] = 1;
+    while (len > 0) {
+      up[path[--len]] = u;
+      done[path[len]] = 1;
+    }
+  }
+  free(done);
+
+  free(path);
+}
+
+// The node a frame says run_k is inside of, or NONE.
+static uint32_t frame_context(struct node f) {
+  switch (f.op) {
+  case DivR:
+  case AddR:
+  case LeR:
+  case NotF:
+  case AssignR:
+  case PrintR:
+  case InvR:
+  case ReturnR:
+  case Ret:
+  case Save:
+  case ArgV:
+    return NONE;
+  case ArgK:
+  case AddL:
+  case DivL:
+  case LeL:
+  case AndL:
+  case WhileC:
+  case IfC:
+  case While:
+    return f.a < count ? parent[f.a] : NONE;
+  }
+  // a statement Seq pushed: what runs now is the one just before it
+  uint32_t s = NONE;
+  if (f.op >> 4 && f.a < count) {
+    s = parent[f.a];
+  } else {
+    uint32_t* slot = slot_for(f);
+    s = *slot != NONE && !dup[*slot] ? *slot : NONE;
+  }
+  uint32_t q = s == NONE ? NONE : parent[s];
+  return q != NONE && permanent[q].op == Seq && permanent[q].b == s ? permanent[q].a : NONE;
+}
+
+// Index of the node a sample was taken in: the context of its
+// innermost frame that has one, or NONE.
+static uint32_t resolve(const struct prof_sample* s) {
+  for (uint32_t f = 0; f < s->nframes; ++f) {
+    uint32_t ctx = frame_context(s->frames[f]);
+    if (ctx != NONE) {
+      return ctx;
+    }
+  }
+  return NONE;
+}
+
+static void print_node(FILE* out, uint32_t ix) {
+  struct node n = permanent[ix];
+  fprintf(out, "[%u] = ", ix);
+  fprintf(out, opnames[n.op], n.a, n.b, n.c, n.immediate);
+}
+
+static int cmp_str(const void* x, const void* y) {
+  return strcmp(*(char* const*)x, *(char* const*)y);
+}
+
+// Writes the per-statement and per-node profile to out, and folded
+// stacks (root;...;node count, one line each, as flamegraph.pl reads
+// them) to the file at folded unless it is NULL.
+void prof_report(FILE* out, const char* folded) {
+  build_maps();
+  uint64_t kept = taken < PROF_SAMPLES ? taken : PROF_SAMPLES;
+  uint64_t* self = calloc(count, sizeof(uint64_t));
+  uint64_t* total = calloc(count, sizeof(uint64_t));
+  uint64_t* stmt = calloc(count, sizeof(uint64_t));
+  uint32_t* at = malloc((kept + 1) * sizeof(uint32_t));
+  uint64_t unknown = 0;
+  for (uint64_t i = 0; i < kept; ++i) {
+    uint32_t ix = resolve(&samples[i]);
+    at[i] = ix;
+    if (ix == NONE) {
+      ++unknown;
+      continue;
+    }
+    ++self[ix];
+    uint32_t s = ix;
+    while (s != NONE && !is_stmt(permanent[s].op)) {
+      s = parent[s];
+    }
+    if (s != NONE) {
+      ++stmt[s];
+    }
+    for (uint32_t p = ix; p != NONE; p = up[p]) {
+      ++total[p];
+    }
+  }
+  double pct = kept ? 100.0 / kept : 0;
+  fprintf(out, "%lu samples kept of %lu taken, %lu unattributed\n",
+          (unsigned long)kept, (unsigned long)taken, (unsigned long)unknown);
+  fprintf(out, "statements:\n   self\n");
+  for (uint32_t i = 0; i < count; ++i) {
+    if (stmt[i]) {
+      fprintf(out, " %5.1f%%  ", stmt[i] * pct);
+      print_node(out, i);
+      fputc('\n', out);
+    }
+  }
+  fprintf(out, "nodes:\n   self   total\n");
+  for (uint32_t i = 0; i < count; ++i) {
+    if (total[i]) {
+      fprintf(out, " %5.1f%%  %5.1f%%  ", self[i] * pct, total[i] * pct);
+      print_node(out, i);
+      fputc('\n', out);
+    }
+  }
+
+  if (folded) {
+    FILE* f = fopen(folded, "w");
+    if (!f) {
+      fprintf(stderr, "cannot write %s\n", folded);
+    } else {
+      // one line per sample, then sort and merge equal stacks
+      char** lines = malloc((kept + 1) * sizeof(char*));
+      uint32_t* chain = malloc((count + 1) * sizeof(uint32_t));
+      uint64_t nl = 0;
+      for (uint64_t i = 0; i < kept; ++i) {
+        if (at[i] == NONE) {
+          continue;
+        }
+        uint32_t depth = 0;
+        for (uint32_t p = at[i]; p != NONE; p = up[p]) {
+          chain[depth++] = p;
+        }
+        char* line = malloc(depth * 32 + 1);
+        char* d = line;
+        while (depth > 0) {
+          uint32_t p = chain[--depth];
+          const char* name = opnames[permanent[p].op];
+          size_t len = strcspn(name, " ");
+          memcpy(d, name, len);
+          d += len;
+          d += sprintf(d, "[%u]%s", p, depth ? ";" : "");
+        }
+        *d = 0;
+        lines[nl++] = line;
+      }
+      qsort(lines, nl, sizeof(char*), cmp_str);
+      for (uint64_t i = 0; i < nl; ) {
+        uint64_t j = i;
+        while (j < nl && !strcmp(lines[i], lines[j])) {
+          ++j;
+        }
+        fprintf(f, "%s %lu\n", lines[i], (unsigned long)(j - i));
+        i = j;
+      }
+      for (uint64_t i = 0; i < nl; ++i) {
+        free(lines[i]);
+      }
+      free(lines);
+      free(chain);
+      fclose(f);
+    }
+  }
+  free(self);
+  free(total);
+  free(stmt);
+  free(at);
+}